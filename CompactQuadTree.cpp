@@ -0,0 +1,245 @@
+#include "CompactQuadTree.h"
+#include "Morton.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <queue>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static constexpr uint32_t maxOffset = 0xFFFF;
+
+// Offset of value from min in steps, rounded to the nearest step
+static uint32_t encodeAxis(float value, float min, float step) {
+    if (step <= 0.0f) {
+        return 0;
+    }
+    double steps = std::nearbyint((static_cast<double>(value) - min) / step);
+    return static_cast<uint32_t>(std::min(std::max(steps, 0.0), static_cast<double>(maxOffset)));
+}
+
+CompactQuadTree::CompactQuadTree(const Rect &boundary, const std::vector<Particle> &particles, size_t leafSize,
+                                 bool mortonOrder)
+        : leafSize(std::max<size_t>(leafSize, 1)), mortonOrder(mortonOrder) {
+    std::vector<Entry> entries;
+    entries.reserve(particles.size());
+    for (const auto &p: particles) {
+        if (!boundary.contains(p.getPosition())) {
+            throw std::runtime_error("Particle outside the compact tree boundary");
+        }
+        entries.push_back({p.getPosition().getX().getValue(), p.getPosition().getY().getValue(),
+                           p.getVelocity().getX().getValue(), p.getVelocity().getY().getValue()});
+    }
+    codes.reserve(entries.size() + 3);
+    velocities.reserve(2 * entries.size());
+
+    nodes.push_back({boundary, 0, 0, 0, 0, -1, 0, 0});
+    build(entries, 0, entries.size(), 0, 0);
+    nodes.shrink_to_fit();
+    // decodeBlock reads whole blocks of four
+    codes.insert(codes.end(), 3, 0);
+}
+
+void CompactQuadTree::build(std::vector<Entry> &entries, size_t first, size_t last, int32_t index,
+                            unsigned depth) {
+    nodes[index].first = static_cast<uint32_t>(codes.size());
+    nodes[index].count = static_cast<uint32_t>(last - first);
+    if (last - first <= leafSize || depth == maxDepth) {
+        encodeLeaf(nodes[index], entries, first, last);
+        return;
+    }
+
+    // same quadrants and split point as PagedQuadTree::build
+    auto regions = nodes[index].boundary.split();
+    float cx = regions[1].getPmin().getX().getValue(), cy = regions[1].getPmin().getY().getValue();
+    auto begin = entries.begin();
+    auto north = std::partition(begin + first, begin + last, [cy](const Entry &e) { return e.y >= cy; });
+    auto nwEnd = std::partition(begin + first, north, [cx](const Entry &e) { return e.x < cx; });
+    auto swEnd = std::partition(north, begin + last, [cx](const Entry &e) { return e.x < cx; });
+    std::array<size_t, 5> bounds = {first, static_cast<size_t>(nwEnd - begin), static_cast<size_t>(north - begin),
+                                    static_cast<size_t>(swEnd - begin), last};
+
+    auto firstChild = static_cast<int32_t>(nodes.size());
+    nodes[index].firstChild = firstChild;
+    for (size_t c = 0; c < 4; ++c) {
+        nodes.push_back({regions[c], 0, 0, 0, 0, -1, 0, 0});
+    }
+    for (size_t c = 0; c < 4; ++c) {
+        build(entries, bounds[c], bounds[c + 1], firstChild + static_cast<int32_t>(c), depth + 1);
+    }
+}
+
+void CompactQuadTree::encodeLeaf(CompactNode &leaf, std::vector<Entry> &entries, size_t first, size_t last) {
+    Point2D pmin = leaf.boundary.getPmin(), pmax = leaf.boundary.getPmax();
+    leaf.minX = pmin.getX().getValue();
+    leaf.minY = pmin.getY().getValue();
+    leaf.stepX = (pmax.getX().getValue() - leaf.minX) / static_cast<float>(maxOffset);
+    leaf.stepY = (pmax.getY().getValue() - leaf.minY) / static_cast<float>(maxOffset);
+
+    // code, Morton key and entry of every particle
+    std::vector<std::array<uint32_t, 3>> leafCodes;
+    for (size_t i = first; i < last; ++i) {
+        uint32_t x = encodeAxis(entries[i].x, leaf.minX, leaf.stepX);
+        uint32_t y = encodeAxis(entries[i].y, leaf.minY, leaf.stepY);
+        leafCodes.push_back({x | (y << 16), mortonEncode(x, y), static_cast<uint32_t>(i - first)});
+    }
+    if (mortonOrder) {
+        std::sort(leafCodes.begin(), leafCodes.end(),
+                  [](const auto &a, const auto &b) { return a[1] < b[1]; });
+    }
+    for (const auto &code: leafCodes) {
+        const Entry &e = entries[first + code[2]];
+        codes.push_back(code[0]);
+        velocities.push_back(e.vx);
+        velocities.push_back(e.vy);
+    }
+}
+
+void CompactQuadTree::decodeBlock(const CompactNode &leaf, size_t i, float *xs, float *ys) const {
+    const uint32_t *block = codes.data() + leaf.first + i;
+#ifdef __SSE2__
+    __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+    __m128 x = _mm_cvtepi32_ps(_mm_and_si128(packed, _mm_set1_epi32(maxOffset)));
+    __m128 y = _mm_cvtepi32_ps(_mm_srli_epi32(packed, 16));
+    _mm_storeu_ps(xs, _mm_add_ps(_mm_set1_ps(leaf.minX), _mm_mul_ps(x, _mm_set1_ps(leaf.stepX))));
+    _mm_storeu_ps(ys, _mm_add_ps(_mm_set1_ps(leaf.minY), _mm_mul_ps(y, _mm_set1_ps(leaf.stepY))));
+#else
+    // same operations as the SSE2 path, so both give the same positions
+    for (size_t j = 0; j < 4; ++j) {
+        xs[j] = leaf.minX + static_cast<float>(block[j] & maxOffset) * leaf.stepX;
+        ys[j] = leaf.minY + static_cast<float>(block[j] >> 16) * leaf.stepY;
+    }
+#endif
+}
+
+Particle CompactQuadTree::decode(const CompactNode &leaf, size_t i) const {
+    uint32_t code = codes[leaf.first + i];
+    float x = leaf.minX + static_cast<float>(code & maxOffset) * leaf.stepX;
+    float y = leaf.minY + static_cast<float>(code >> 16) * leaf.stepY;
+    const float *velocity = velocities.data() + 2 * (leaf.first + i);
+    return {Point2D(x, y), Point2D(velocity[0], velocity[1])};
+}
+
+std::vector<Particle> CompactQuadTree::knn(Point2D query, size_t k) const {
+    if (k == 0 || size() == 0) {
+        return {};
+    }
+    float qx = query.getX().getValue(), qy = query.getY().getValue();
+    // best-first search like PagedQuadTree::knn, on squared float distances
+    struct Candidate {
+        float dist;
+        int32_t leaf;
+        uint32_t index;
+
+        bool operator<(const Candidate &other) const { return dist < other.dist; }
+    };
+    std::priority_queue<Candidate> maxHeap;
+    using Frontier = std::pair<float, int32_t>;
+    std::priority_queue<Frontier, std::vector<Frontier>, std::greater<>> pq;
+
+    auto nodeDistance = [&](int32_t index) {
+        NType d = nodes[index].boundary.distance(query);
+        return d.getValue() * d.getValue();
+    };
+    pq.emplace(nodeDistance(0), 0);
+    while (!pq.empty()) {
+        auto [dist, index] = pq.top();
+        pq.pop();
+        if (maxHeap.size() == k && dist > maxHeap.top().dist) {
+            break;
+        }
+        const CompactNode &node = nodes[index];
+        if (!node.isLeaf()) {
+            for (int32_t child = node.firstChild; child < node.firstChild + 4; ++child) {
+                if (nodes[child].count == 0) {
+                    continue;
+                }
+                float childDist = nodeDistance(child);
+                if (maxHeap.size() < k || childDist <= maxHeap.top().dist) {
+                    pq.emplace(childDist, child);
+                }
+            }
+            continue;
+        }
+        float xs[4], ys[4];
+        for (uint32_t i = 0; i < node.count; i += 4) {
+            decodeBlock(node, i, xs, ys);
+            uint32_t inBlock = std::min<uint32_t>(4, node.count - i);
+            for (uint32_t j = 0; j < inBlock; ++j) {
+                float dx = xs[j] - qx, dy = ys[j] - qy;
+                float d = dx * dx + dy * dy;
+                if (maxHeap.size() < k) {
+                    maxHeap.push({d, index, i + j});
+                } else if (d < maxHeap.top().dist) {
+                    maxHeap.pop();
+                    maxHeap.push({d, index, i + j});
+                }
+            }
+        }
+    }
+
+    std::vector<Particle> topK;
+    while (!maxHeap.empty()) {
+        topK.push_back(decode(nodes[maxHeap.top().leaf], maxHeap.top().index));
+        maxHeap.pop();
+    }
+    std::reverse(topK.begin(), topK.end());
+    return topK;
+}
+
+std::vector<Particle> CompactQuadTree::range(const Rect &region) const {
+    std::vector<Particle> result;
+    std::vector<int32_t> stack = {0};
+    while (!stack.empty()) {
+        int32_t index = stack.back();
+        stack.pop_back();
+        const CompactNode &node = nodes[index];
+        if (node.count == 0 || !node.boundary.overlaps(region)) {
+            continue;
+        }
+        if (!node.isLeaf()) {
+            for (int32_t child = node.firstChild + 3; child >= node.firstChild; --child) {
+                stack.push_back(child);
+            }
+            continue;
+        }
+        float xs[4], ys[4];
+        for (uint32_t i = 0; i < node.count; i += 4) {
+            decodeBlock(node, i, xs, ys);
+            uint32_t inBlock = std::min<uint32_t>(4, node.count - i);
+            for (uint32_t j = 0; j < inBlock; ++j) {
+                if (region.contains(Point2D(xs[j], ys[j]))) {
+                    result.push_back(decode(node, i + j));
+                }
+            }
+        }
+    }
+    return result;
+}
+
+std::vector<Particle> CompactQuadTree::getParticles() const {
+    std::vector<Particle> particles;
+    particles.reserve(size());
+    std::vector<int32_t> stack = {0};
+    while (!stack.empty()) {
+        const CompactNode &node = nodes[stack.back()];
+        stack.pop_back();
+        if (!node.isLeaf()) {
+            for (int32_t child = node.firstChild + 3; child >= node.firstChild; --child) {
+                stack.push_back(child);
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < node.count; ++i) {
+            particles.push_back(decode(node, i));
+        }
+    }
+    return particles;
+}
+
+size_t CompactQuadTree::memoryUsage() const {
+    return nodes.capacity() * sizeof(CompactNode) + codes.capacity() * sizeof(uint32_t) +
+           velocities.capacity() * sizeof(float);
+}
@@ -0,0 +1,69 @@
+#ifndef COMPACTQUADTREE_H
+#define COMPACTQUADTREE_H
+
+#include "Particle.h"
+#include "Rect.h"
+#include <cstdint>
+#include <vector>
+
+// Read-only quadtree that stores each particle position in 4 bytes instead of a shared_ptr<Particle>:
+// 16-bit x and y offsets from the pmin corner of the particle's leaf, in steps of 1/65535 of the leaf
+// side. A decoded position is within half a step of the original on each axis. Velocities are kept as
+// two floats. Leaves are decoded four particles at a time (SSE2 where available) and queries return
+// copies of the decoded particles, like PagedQuadTree, so results are exact for the stored positions.
+// Build a new tree to follow moving particles. Queries do not modify the tree and may run concurrently.
+class CompactQuadTree {
+private:
+    struct CompactNode {
+        Rect boundary;
+        float minX, minY, stepX, stepY; // decoding of the codes of a leaf
+        int32_t firstChild;             // NW, NE, SW, SE are stored together; -1 on leaves
+        uint32_t first, count;          // particles of the subtree, contiguous in codes
+
+        bool isLeaf() const { return firstChild < 0; }
+    };
+
+    // A particle while the tree is built
+    struct Entry {
+        float x, y, vx, vy;
+    };
+
+    std::vector<CompactNode> nodes; // nodes[0] is the root
+    std::vector<uint32_t> codes;    // x offset in the low 16 bits, y offset in the high 16 bits
+    std::vector<float> velocities;  // vx, vy per particle
+    size_t leafSize;
+    bool mortonOrder;
+
+    static constexpr unsigned maxDepth = 32;
+
+    void build(std::vector<Entry> &entries, size_t first, size_t last, int32_t index, unsigned depth);
+
+    void encodeLeaf(CompactNode &leaf, std::vector<Entry> &entries, size_t first, size_t last);
+
+    // Positions of particles [i, i + 4) of leaf; codes is padded so the last block can be read whole
+    void decodeBlock(const CompactNode &leaf, size_t i, float *xs, float *ys) const;
+
+    Particle decode(const CompactNode &leaf, size_t i) const;
+
+public:
+    // Particles outside boundary are rejected with std::runtime_error. Leaves split above leafSize
+    // particles. mortonOrder sorts the particles of every leaf along the Z-order curve of their codes.
+    CompactQuadTree(const Rect &boundary, const std::vector<Particle> &particles, size_t leafSize = 64,
+                    bool mortonOrder = false);
+
+    std::vector<Particle> knn(Point2D query, size_t k) const;
+
+    std::vector<Particle> range(const Rect &region) const;
+
+    // Decoded particles in storage order (leaf depth-first order)
+    std::vector<Particle> getParticles() const;
+
+    size_t size() const { return nodes[0].count; }
+
+    // Bytes held by nodes, position codes and velocities
+    size_t memoryUsage() const;
+
+    static constexpr size_t positionBytes = sizeof(uint32_t);
+};
+
+#endif // COMPACTQUADTREE_H
@@ -0,0 +1,31 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "Quantizer.h"
+#include <cstdint>
+
+// Z-order (Morton) codes: interleaving the bits of the grid coordinates keeps points that are close in
+// space close in code order. Used to sort work and storage for locality.
+
+// Spreads the low 16 bits of v to the even bit positions
+inline uint32_t mortonSpread(uint32_t v) {
+    v &= 0x0000FFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+inline uint32_t mortonEncode(uint32_t x, uint32_t y) {
+    return mortonSpread(x) | (mortonSpread(y) << 1);
+}
+
+// Code of p on a 16-bit grid
+inline uint32_t mortonEncode(const Quantizer &quantizer, const Point2D &p) {
+    std::array<uint32_t, 2> code = quantizer.quantize(p);
+    unsigned shift = quantizer.getBits() > 16 ? quantizer.getBits() - 16 : 0;
+    return mortonEncode(code[0] >> shift, code[1] >> shift);
+}
+
+#endif // MORTON_H
@@ -0,0 +1,394 @@
+#include "PagedQuadTree.h"
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+PagedQuadTree::File::~File() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void writeAll(int fd, const void *data, size_t bytes, size_t offset, const char *error) {
+    const char *source = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t written = pwrite(fd, source, bytes, static_cast<off_t>(offset));
+        if (written <= 0) {
+            throw std::runtime_error(error);
+        }
+        source += written;
+        offset += static_cast<size_t>(written);
+        bytes -= static_cast<size_t>(written);
+    }
+}
+
+static void readRecords(int fd, size_t first, PagedQuadTree::Record *out, size_t count) {
+    char *target = reinterpret_cast<char *>(out);
+    size_t bytes = count * sizeof(PagedQuadTree::Record), offset = first * sizeof(PagedQuadTree::Record);
+    while (bytes > 0) {
+        ssize_t got = pread(fd, target, bytes, static_cast<off_t>(offset));
+        if (got <= 0) {
+            throw std::runtime_error("Cannot read scratch file");
+        }
+        target += got;
+        offset += static_cast<size_t>(got);
+        bytes -= static_cast<size_t>(got);
+    }
+}
+
+static int openScratch(const std::string &path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open scratch file " + path);
+    }
+    // nothing is left behind, whatever happens to the build
+    unlink(path.c_str());
+    return fd;
+}
+
+// Hands out particles in chunks of up to chunkSize copies
+static PagedQuadTree::ParticleSource chunksOf(const std::vector<Particle> &particles, size_t chunkSize) {
+    chunkSize = std::max<size_t>(chunkSize, 1);
+    return [&particles, chunkSize, next = size_t(0)](std::vector<Particle> &chunk) mutable {
+        size_t end = std::min(particles.size(), next + chunkSize);
+        chunk.assign(particles.begin() + static_cast<std::ptrdiff_t>(next),
+                     particles.begin() + static_cast<std::ptrdiff_t>(end));
+        bool filled = end > next;
+        next = end;
+        return filled;
+    };
+}
+
+PagedQuadTree::PagedQuadTree(const std::string &path, const Rect &boundary, const ParticleSource &source,
+                             size_t pageSize, size_t cachePages, size_t memoryRecords)
+        : pageSize(pageSize), recordsPerPage(pageSize / sizeof(Record)),
+          memoryRecords(std::max(memoryRecords, recordsPerPage)), cachePages(std::max<size_t>(cachePages, 1)) {
+    long systemPageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize == 0 || systemPageSize <= 0 || pageSize % static_cast<size_t>(systemPageSize) != 0) {
+        throw std::runtime_error("Page size must be a multiple of the system page size");
+    }
+
+    file.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file.fd < 0) {
+        throw std::runtime_error("Cannot open page file " + path);
+    }
+    File spilled(openScratch(path + ".scratch0")), partitioned(openScratch(path + ".scratch1"));
+
+    // spill the input chunk by chunk
+    size_t total = 0;
+    std::vector<Particle> chunk;
+    std::vector<Record> records;
+    while (chunk.clear(), source(chunk)) {
+        records.clear();
+        for (const auto &p: chunk) {
+            if (!boundary.contains(p.getPosition())) {
+                throw std::runtime_error("Particle outside the paged tree boundary");
+            }
+            records.push_back({p.getPosition().getX().getValue(), p.getPosition().getY().getValue(),
+                               p.getVelocity().getX().getValue(), p.getVelocity().getY().getValue()});
+        }
+        writeAll(spilled.fd, records.data(), records.size() * sizeof(Record), total * sizeof(Record),
+                     "Cannot write scratch file");
+        total += records.size();
+    }
+    std::vector<Particle>().swap(chunk);
+    std::vector<Record>().swap(records);
+
+    buildFromFile(spilled, partitioned, 0, total, boundary, -1, 0);
+
+    mappedSize = numPages * pageSize;
+    if (mappedSize > 0) {
+        void *addr = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, file.fd, 0);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error("Cannot map page file " + path);
+        }
+        mapped = static_cast<char *>(addr);
+        // access is random by nature, leave readahead to the sibling prefetch
+        madvise(mapped, mappedSize, MADV_RANDOM);
+    }
+}
+
+PagedQuadTree::PagedQuadTree(const std::string &path, const Rect &boundary, const std::vector<Particle> &particles,
+                             size_t pageSize, size_t cachePages, size_t memoryRecords)
+        : PagedQuadTree(path, boundary, chunksOf(particles, memoryRecords), pageSize, cachePages, memoryRecords) {}
+
+PagedQuadTree::~PagedQuadTree() {
+    if (mapped != nullptr) {
+        munmap(mapped, mappedSize);
+    }
+}
+
+int32_t PagedQuadTree::buildFromFile(const File &from, const File &to, size_t first, size_t last, Rect boundary,
+                                     int32_t parent, unsigned depth) {
+    size_t count = last - first;
+    if (count <= memoryRecords) {
+        std::vector<Record> records(count);
+        readRecords(from.fd, first, records.data(), count);
+        return build(records, 0, count, boundary, parent, depth);
+    }
+
+    auto index = static_cast<int32_t>(nodes.size());
+    nodes.push_back({boundary, parent, {-1, -1, -1, -1}, 0, 0, static_cast<uint32_t>(count)});
+    if (depth == maxDepth) {
+        // too many records on one spot to load at once, copy them into the leaf a few pages at a time
+        nodes[index].firstPage = static_cast<uint32_t>(numPages);
+        size_t piece = memoryRecords / recordsPerPage * recordsPerPage;
+        std::vector<Record> records(piece);
+        for (size_t i = first; i < last; i += piece) {
+            size_t n = std::min(piece, last - i);
+            readRecords(from.fd, i, records.data(), n);
+            appendPages(nodes[index], records.data(), n);
+        }
+        return index;
+    }
+
+    // the quadrants of build, counted in one pass and written to their ranges of the other file in a second
+    auto regions = boundary.split();
+    float cx = regions[1].getPmin().getX().getValue(), cy = regions[1].getPmin().getY().getValue();
+    auto quadrant = [cx, cy](const Record &r) { return (r.y >= cy ? 0 : 2) + (r.x < cx ? 0 : 1); };
+    size_t piece = memoryRecords / 2, flushSize = std::max<size_t>(memoryRecords / 8, 1);
+    std::vector<Record> input(piece);
+    std::array<size_t, 4> counts{};
+    for (size_t i = first; i < last; i += piece) {
+        size_t n = std::min(piece, last - i);
+        readRecords(from.fd, i, input.data(), n);
+        for (size_t j = 0; j < n; ++j) {
+            ++counts[quadrant(input[j])];
+        }
+    }
+    std::array<size_t, 5> bounds = {first};
+    for (size_t c = 0; c < 4; ++c) {
+        bounds[c + 1] = bounds[c] + counts[c];
+    }
+
+    std::array<size_t, 4> next = {bounds[0], bounds[1], bounds[2], bounds[3]};
+    std::array<std::vector<Record>, 4> output;
+    auto flush = [&](size_t c) {
+        writeAll(to.fd, output[c].data(), output[c].size() * sizeof(Record), next[c] * sizeof(Record),
+                     "Cannot write scratch file");
+        next[c] += output[c].size();
+        output[c].clear();
+    };
+    for (size_t i = first; i < last; i += piece) {
+        size_t n = std::min(piece, last - i);
+        readRecords(from.fd, i, input.data(), n);
+        for (size_t j = 0; j < n; ++j) {
+            auto c = static_cast<size_t>(quadrant(input[j]));
+            output[c].push_back(input[j]);
+            if (output[c].size() == flushSize) {
+                flush(c);
+            }
+        }
+    }
+    for (size_t c = 0; c < 4; ++c) {
+        flush(c);
+    }
+    std::vector<Record>().swap(input);
+    for (auto &buffer: output) {
+        std::vector<Record>().swap(buffer);
+    }
+
+    // the children partition their ranges back into the first file
+    for (size_t c = 0; c < 4; ++c) {
+        int32_t child = buildFromFile(to, from, bounds[c], bounds[c + 1], regions[c], index, depth + 1);
+        nodes[index].children[c] = child;
+    }
+    return index;
+}
+
+int32_t PagedQuadTree::build(std::vector<Record> &records, size_t first, size_t last, Rect boundary,
+                             int32_t parent, unsigned depth) {
+    auto index = static_cast<int32_t>(nodes.size());
+    nodes.push_back({boundary, parent, {-1, -1, -1, -1}, 0, 0, static_cast<uint32_t>(last - first)});
+
+    if (last - first <= recordsPerPage || depth == maxDepth) {
+        writeLeaf(nodes[index], records, first, last);
+        return index;
+    }
+
+    // same quadrants as QuadNode, split at the corner Rect::split uses so records stay inside their child
+    auto regions = boundary.split();
+    float cx = regions[1].getPmin().getX().getValue(), cy = regions[1].getPmin().getY().getValue();
+    auto begin = records.begin();
+    auto north = std::partition(begin + first, begin + last, [cy](const Record &r) { return r.y >= cy; });
+    auto nwEnd = std::partition(begin + first, north, [cx](const Record &r) { return r.x < cx; });
+    auto swEnd = std::partition(north, begin + last, [cx](const Record &r) { return r.x < cx; });
+    std::array<size_t, 5> bounds = {first, static_cast<size_t>(nwEnd - begin), static_cast<size_t>(north - begin),
+                                    static_cast<size_t>(swEnd - begin), last};
+    // partition order is NW, NE, SW, SE, matching Rect::split
+    for (size_t c = 0; c < 4; ++c) {
+        int32_t child = build(records, bounds[c], bounds[c + 1], regions[c], index, depth + 1);
+        nodes[index].children[c] = child;
+    }
+    return index;
+}
+
+void PagedQuadTree::writeLeaf(PagedNode &leaf, const std::vector<Record> &records, size_t first, size_t last) {
+    leaf.firstPage = static_cast<uint32_t>(numPages);
+    leaf.pageCount = 0;
+    appendPages(leaf, records.data() + first, last - first);
+}
+
+void PagedQuadTree::appendPages(PagedNode &leaf, const Record *records, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    size_t pages = (count + recordsPerPage - 1) / recordsPerPage;
+    std::vector<char> buffer(pages * pageSize, 0);
+    for (size_t i = 0; i < count; ++i) {
+        size_t page = i / recordsPerPage, slot = i % recordsPerPage;
+        std::memcpy(buffer.data() + page * pageSize + slot * sizeof(Record), &records[i], sizeof(Record));
+    }
+    writeAll(file.fd, buffer.data(), buffer.size(), numPages * pageSize, "Cannot write page file");
+    leaf.pageCount += static_cast<uint32_t>(pages);
+    numPages += pages;
+}
+
+void PagedQuadTree::touch(uint32_t page, bool prefetch) {
+    auto it = resident.find(page);
+    if (it != resident.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        if (!prefetch) {
+            ++pageHits;
+        }
+        return;
+    }
+    if (prefetch) {
+        ++pagePrefetches;
+    } else {
+        ++pageMisses;
+    }
+    madvise(mapped + page * pageSize, pageSize, MADV_WILLNEED);
+    lru.push_front(page);
+    resident[page] = lru.begin();
+    if (lru.size() > cachePages) {
+        // drop the least recently used page from memory, the file still backs it
+        uint32_t evicted = lru.back();
+        lru.pop_back();
+        resident.erase(evicted);
+        madvise(mapped + evicted * pageSize, pageSize, MADV_DONTNEED);
+    }
+}
+
+const PagedQuadTree::Record *PagedQuadTree::loadPage(uint32_t page) {
+    touch(page, false);
+    return reinterpret_cast<const Record *>(mapped + page * pageSize);
+}
+
+void PagedQuadTree::prefetchSiblings(int32_t leaf) {
+    int32_t parent = nodes[leaf].parent;
+    if (parent < 0) {
+        return;
+    }
+    for (int32_t sibling: nodes[parent].children) {
+        if (sibling != leaf && nodes[sibling].isLeaf() && nodes[sibling].count > 0) {
+            touch(nodes[sibling].firstPage, true);
+        }
+    }
+}
+
+template<typename Visitor>
+void PagedQuadTree::scanLeaf(int32_t leaf, Visitor visit) {
+    const PagedNode &node = nodes[leaf];
+    size_t remaining = node.count;
+    for (uint32_t page = node.firstPage; remaining > 0; ++page) {
+        const Record *records = loadPage(page);
+        size_t inPage = std::min(remaining, recordsPerPage);
+        for (size_t i = 0; i < inPage; ++i) {
+            visit(records[i]);
+        }
+        remaining -= inPage;
+    }
+    prefetchSiblings(leaf);
+}
+
+static Particle toParticle(const PagedQuadTree::Record &r) {
+    return {Point2D(r.x, r.y), Point2D(r.vx, r.vy)};
+}
+
+std::vector<Particle> PagedQuadTree::knn(Point2D query, size_t k) {
+    if (nodes.empty() || k == 0) {
+        return {};
+    }
+    float qx = query.getX().getValue(), qy = query.getY().getValue();
+    // best-first search like QuadTree::knn, on squared float distances
+    using Candidate = std::pair<float, Record>;
+    auto farther = [](const Candidate &a, const Candidate &b) { return a.first < b.first; };
+    std::priority_queue<Candidate, std::vector<Candidate>, decltype(farther)> maxHeap(farther);
+    using Frontier = std::pair<float, int32_t>;
+    std::priority_queue<Frontier, std::vector<Frontier>, std::greater<>> pq;
+
+    auto nodeDistance = [&](int32_t index) {
+        NType d = nodes[index].boundary.distance(query);
+        return d.getValue() * d.getValue();
+    };
+    pq.emplace(nodeDistance(0), 0);
+    while (!pq.empty()) {
+        auto [dist, index] = pq.top();
+        pq.pop();
+        if (maxHeap.size() == k && dist > maxHeap.top().first) {
+            break;
+        }
+        const PagedNode &node = nodes[index];
+        if (!node.isLeaf()) {
+            for (int32_t child: node.children) {
+                if (nodes[child].count == 0) {
+                    continue;
+                }
+                float childDist = nodeDistance(child);
+                if (maxHeap.size() < k || childDist <= maxHeap.top().first) {
+                    pq.emplace(childDist, child);
+                }
+            }
+            continue;
+        }
+        scanLeaf(index, [&](const Record &r) {
+            float dx = r.x - qx, dy = r.y - qy;
+            float d = dx * dx + dy * dy;
+            if (maxHeap.size() < k) {
+                maxHeap.emplace(d, r);
+            } else if (d < maxHeap.top().first) {
+                maxHeap.pop();
+                maxHeap.emplace(d, r);
+            }
+        });
+    }
+
+    std::vector<Particle> topK;
+    while (!maxHeap.empty()) {
+        topK.push_back(toParticle(maxHeap.top().second));
+        maxHeap.pop();
+    }
+    std::reverse(topK.begin(), topK.end());
+    return topK;
+}
+
+std::vector<Particle> PagedQuadTree::range(const Rect &region) {
+    std::vector<Particle> result;
+    if (nodes.empty()) {
+        return result;
+    }
+    std::vector<int32_t> stack = {0};
+    while (!stack.empty()) {
+        int32_t index = stack.back();
+        stack.pop_back();
+        const PagedNode &node = nodes[index];
+        if (node.count == 0 || !node.boundary.overlaps(region)) {
+            continue;
+        }
+        if (!node.isLeaf()) {
+            stack.insert(stack.end(), node.children.rbegin(), node.children.rend());
+            continue;
+        }
+        scanLeaf(index, [&](const Record &r) {
+            if (region.contains(Point2D(r.x, r.y))) {
+                result.push_back(toParticle(r));
+            }
+        });
+    }
+    return result;
+}
@@ -0,0 +1,134 @@
+#ifndef PAGEDQUADTREE_H
+#define PAGEDQUADTREE_H
+
+#include "Particle.h"
+#include "Rect.h"
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Disk-backed, read-only quadtree for particle sets that do not fit in memory as shared_ptr<Particle>.
+// Internal nodes stay in memory; every leaf bucket is one fixed-size page (several only at the depth
+// limit) of a memory-mapped file. The input is streamed in chunks and partitioned on disk, so building
+// never holds more than a bounded number of records in RAM. An LRU list of cachePages pages decides
+// which pages should stay resident and the sibling leaves of each visited leaf are prefetched; both
+// only reach the kernel as madvise hints (MADV_WILLNEED / MADV_DONTNEED), which it is free to ignore,
+// so the LRU does not hard-limit resident memory. Queries return copies of the stored particles.
+// Not thread-safe: queries update the page cache.
+class PagedQuadTree {
+public:
+    // On-disk layout of one particle
+    struct Record {
+        float x, y, vx, vy;
+    };
+
+    // Supplies the input a chunk at a time: fills chunk, which the caller has emptied, and returns false
+    // once there is nothing left
+    using ParticleSource = std::function<bool(std::vector<Particle> &chunk)>;
+
+private:
+    // Owns a file descriptor, so a build that throws does not leak it
+    class File {
+    public:
+        int fd = -1;
+
+        File() = default;
+
+        explicit File(int fd) : fd(fd) {}
+
+        File(const File &) = delete;
+
+        File &operator=(const File &) = delete;
+
+        ~File();
+    };
+
+    struct PagedNode {
+        Rect boundary;
+        int32_t parent;
+        std::array<int32_t, 4> children; // NW, NE, SW, SE; -1 on leaves
+        uint32_t firstPage, pageCount, count;
+
+        bool isLeaf() const { return children[0] < 0; }
+    };
+
+    std::vector<PagedNode> nodes; // nodes[0] is the root
+    size_t pageSize;
+    size_t recordsPerPage;
+    size_t numPages = 0;
+    size_t memoryRecords;
+    File file;
+    char *mapped = nullptr;
+    size_t mappedSize = 0;
+
+    // LRU of resident pages, most recent first
+    size_t cachePages;
+    std::list<uint32_t> lru;
+    std::unordered_map<uint32_t, std::list<uint32_t>::iterator> resident;
+    size_t pageHits = 0, pageMisses = 0, pagePrefetches = 0;
+
+    static constexpr unsigned maxDepth = 32;
+
+    int32_t build(std::vector<Record> &records, size_t first, size_t last, Rect boundary, int32_t parent,
+                  unsigned depth);
+
+    // Same tree for records [first, last) of a scratch file: ranges that fit in memoryRecords are loaded
+    // and built in memory, larger ones are partitioned into the same range of the other scratch file
+    int32_t buildFromFile(const File &from, const File &to, size_t first, size_t last, Rect boundary,
+                          int32_t parent, unsigned depth);
+
+    void writeLeaf(PagedNode &leaf, const std::vector<Record> &records, size_t first, size_t last);
+
+    // Writes count records as whole pages after the last page of leaf, which must be the last leaf written
+    void appendPages(PagedNode &leaf, const Record *records, size_t count);
+
+    const Record *loadPage(uint32_t page);
+
+    void prefetchSiblings(int32_t leaf);
+
+    void touch(uint32_t page, bool prefetch);
+
+    // Records of a leaf, page by page
+    template<typename Visitor>
+    void scanLeaf(int32_t leaf, Visitor visit);
+
+public:
+    // Writes the particles of source into path (truncating it) and maps it. Particles outside boundary
+    // are rejected with std::runtime_error. pageSize must be a multiple of the system page size;
+    // cachePages is the number of pages the LRU keeps resident; at most memoryRecords records (16 bytes
+    // each) are held in memory at a time, plus the chunk source fills. Two scratch files next to path
+    // hold the records while they are partitioned and are removed right away.
+    PagedQuadTree(const std::string &path, const Rect &boundary, const ParticleSource &source,
+                  size_t pageSize = 4096, size_t cachePages = 1024, size_t memoryRecords = size_t(1) << 20);
+
+    // Same from particles already in memory
+    PagedQuadTree(const std::string &path, const Rect &boundary, const std::vector<Particle> &particles,
+                  size_t pageSize = 4096, size_t cachePages = 1024, size_t memoryRecords = size_t(1) << 20);
+
+    ~PagedQuadTree();
+
+    PagedQuadTree(const PagedQuadTree &) = delete;
+
+    PagedQuadTree &operator=(const PagedQuadTree &) = delete;
+
+    std::vector<Particle> knn(Point2D query, size_t k);
+
+    std::vector<Particle> range(const Rect &region);
+
+    size_t size() const { return nodes.empty() ? 0 : nodes[0].count; }
+
+    // Page cache counters; prefetched pages count as hits once queried
+    size_t getPageHits() const { return pageHits; }
+
+    size_t getPageMisses() const { return pageMisses; }
+
+    size_t getPagePrefetches() const { return pagePrefetches; }
+
+    void resetPageStats() { pageHits = pageMisses = pagePrefetches = 0; }
+};
+
+#endif // PAGEDQUADTREE_H
@@ -1,59 +1,186 @@
 #include "QuadTree.h"
 #include <queue>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <thread>
 
 size_t QuadTree::bucketSize = 6;
+const QuadTreeOptions QuadTreeOptions::defaults;
+
+size_t QuadTree::size() const {
+    return root->getCount();
+}
+
+size_t QuadTree::countInRect(const Rect &region) const {
+    return count(RectShape(region));
+}
+
+void QuadTree::collectSubtree(const QuadNode &node, std::vector<std::shared_ptr<Particle>> &result) {
+    if (node.isLeaf()) {
+        result.insert(result.end(), node.getParticles().begin(), node.getParticles().end());
+        return;
+    }
+    for (const auto &child: node.getChildren()) {
+        collectSubtree(*child, result);
+    }
+}
+
+std::vector<size_t> QuadTree::densityGrid(size_t rows, size_t cols) const {
+    QT_TRACE_SCOPE("QuadTree::densityGrid");
+    std::vector<size_t> grid(rows * cols, 0);
+    if (rows == 0 || cols == 0) {
+        return grid;
+    }
+    const Rect &area = root->getBoundary();
+    float xmin = area.getPmin().getX().getValue(), ymin = area.getPmin().getY().getValue();
+    float cellWidth = (area.getPmax().getX().getValue() - xmin) / static_cast<float>(cols);
+    float cellHeight = (area.getPmax().getY().getValue() - ymin) / static_cast<float>(rows);
+    auto column = [&](NType x) {
+        return static_cast<size_t>(std::clamp(std::floor((x.getValue() - xmin) / cellWidth), 0.0f,
+                                              static_cast<float>(cols - 1)));
+    };
+    auto row = [&](NType y) {
+        return static_cast<size_t>(std::clamp(std::floor((y.getValue() - ymin) / cellHeight), 0.0f,
+                                              static_cast<float>(rows - 1)));
+    };
+    densityGrid(*root, grid, cols, column, row);
+    return grid;
+}
+
+template<typename Column, typename Row>
+void QuadTree::densityGrid(const QuadNode &node, std::vector<size_t> &grid, size_t cols, Column column, Row row) {
+    if (node.getCount() == 0) {
+        return;
+    }
+    // a subtree that falls inside one grid cell is added as a whole
+    Rect bounds = node.getSearchBounds();
+    size_t firstColumn = column(bounds.getPmin().getX()), firstRow = row(bounds.getPmin().getY());
+    if (firstColumn == column(bounds.getPmax().getX()) && firstRow == row(bounds.getPmax().getY())) {
+        grid[firstRow * cols + firstColumn] += node.getCount();
+    } else if (node.isLeaf()) {
+        for (const auto &particle: node.getParticles()) {
+            grid[row(particle->getPosition().getY()) * cols + column(particle->getPosition().getX())] += 1;
+        }
+    } else {
+        for (const auto &child: node.getChildren()) {
+            densityGrid(*child, grid, cols, column, row);
+        }
+    }
+}
 
 void QuadTree::updateTree() {
-    root->updateNode();
+    QT_TRACE_SCOPE("QuadTree::updateTree");
+    relocationsSinceReorder += root->updateNode();
+}
+
+void QuadTree::updateTree(std::vector<std::shared_ptr<Particle>> &escaped) {
+    QT_TRACE_SCOPE("QuadTree::updateTree");
+    relocationsSinceReorder += root->updateNode(&escaped);
 }
 
 const std::shared_ptr<QuadNode> &QuadTree::getRoot() const { return root; }
 
 void QuadTree::insert(const std::vector<std::shared_ptr<Particle>> &particles) {
+    QT_TRACE_SCOPE("QuadTree::insert");
     for (const auto &particle: particles) {
         root->insert(particle);
     }
+    relocationsSinceReorder += particles.size();
 }
 
 std::vector<std::shared_ptr<Particle>> QuadTree::knn(Point2D query, size_t k) {
-    // best-first search the leaves and prune
+    QT_TRACE_SCOPE("QuadTree::knn");
+    std::vector<std::shared_ptr<Particle>> result;
+    if (k > 0 && k <= smallK && knnSmall(query, k, result)) {
+        return result;
+    }
+    return knnSearch(
+            k,
+            [&query](const QuadNode &node) { return node.getSearchBounds().distance(query).getValue(); },
+            [&query](const Particle &p) { return query.distance(p.getPosition()).getValue(); });
+}
+
+std::vector<std::shared_ptr<Particle>> QuadTree::knn(Point2D query, size_t k, NType horizon) const {
+    QT_TRACE_SCOPE("QuadTree::knn predictive");
+    if (!options->trackVelocity) {
+        throw std::runtime_error("Predictive queries require enableVelocityBounds()");
+    }
+    if (horizon < 0.0f) {
+        throw std::runtime_error("Predictive queries need a horizon >= 0");
+    }
+    return knnSearch(
+            k,
+            [&query, &horizon](const QuadNode &node) {
+                if (!node.getVelocityBounds().isValid()) {
+                    // empty subtree
+                    return std::numeric_limits<float>::infinity();
+                }
+                Rect predicted = node.getSearchBounds().advance(node.getVelocityBounds(), horizon);
+                return predicted.distance(query).getValue();
+            },
+            [&query, &horizon](const Particle &p) {
+                return query.distance(p.getPosition() + p.getVelocity() * horizon).getValue();
+            });
+}
+
+template<typename NodeDistance, typename ParticleDistance>
+std::vector<std::shared_ptr<Particle>>
+QuadTree::knnSearch(size_t k, NodeDistance nodeDistance, ParticleDistance particleDistance) const {
     if (root == nullptr || k == 0) {
         return {};
     }
-    std::priority_queue<KNNParticlePair, std::vector<KNNParticlePair>, std::less<>> maxHeap;
+    KNNMaxHeap maxHeap;
+    if (root->getCount() > 0) {
+        knnSearchFrom(root, k, nodeDistance, particleDistance, maxHeap);
+    }
+    return extractKnn(maxHeap);
+}
+
+template<typename NodeDistance, typename ParticleDistance>
+void QuadTree::knnSearchFrom(const std::shared_ptr<QuadNode> &start, size_t k, NodeDistance nodeDistance,
+                             ParticleDistance particleDistance, KNNMaxHeap &maxHeap) {
+    // best-first search the leaves and prune
     std::priority_queue<KNNTreePair, std::vector<KNNTreePair>, std::greater<>> pq;
-    pq.emplace(root, query);
+    pq.emplace(start, nodeDistance(*start));
     while (!pq.empty()) {
         KNNTreePair curr = pq.top();
         pq.pop();
+        if (maxHeap.size() == k && curr.distToQuery > maxHeap.top().distToQuery) {
+            // every remaining node is further than the worst nearest
+            break;
+        }
         if (!curr.node->isLeaf()) {
-            auto children = curr.node->getChildren();
-            // cant prune
-            if (maxHeap.size() < k) {
-                for (const auto &child: children) {
-                    pq.emplace(child, query);
+            for (const auto &child: curr.node->getChildren()) {
+                if (child->getCount() == 0) {
+                    continue;
                 }
-            } else {
-                // can prune, if its further than the worst nearest no need to check
-                for (const auto &child: children) {
-                    if (child->getBoundary().distance(query).getValue() <= maxHeap.top().distToQuery) {
-                        pq.emplace(child, query);
-                    }
+                float childDist = nodeDistance(*child);
+                // can prune if its further than the worst nearest
+                if (childDist != std::numeric_limits<float>::infinity() &&
+                    (maxHeap.size() < k || childDist <= maxHeap.top().distToQuery)) {
+                    pq.emplace(child, childDist);
                 }
             }
         } else {
             for (const std::shared_ptr<Particle> &p: curr.node->getParticles()) {
+                float dist = particleDistance(*p);
+                if (dist == std::numeric_limits<float>::infinity()) {
+                    continue;
+                }
                 if (maxHeap.size() < k) {
-                    maxHeap.emplace(p, query);
-                } else if (maxHeap.top().distToQuery > query.distance(p->getPosition()).getValue()) {
+                    maxHeap.emplace(p, dist);
+                } else if (maxHeap.top().distToQuery > dist) {
                     maxHeap.pop();
-                    maxHeap.emplace(p, query);
+                    maxHeap.emplace(p, dist);
                 }
             }
         }
 
     }
+}
 
+std::vector<std::shared_ptr<Particle>> QuadTree::extractKnn(KNNMaxHeap &maxHeap) {
     std::vector<std::shared_ptr<Particle>> topK;
     while (!maxHeap.empty()) {
         topK.push_back(maxHeap.top().particle);
@@ -63,6 +190,442 @@ std::vector<std::shared_ptr<Particle>> QuadTree::knn(Point2D query, size_t k) {
     return topK;
 }
 
+std::vector<std::shared_ptr<Particle>> QuadTree::range(const Rect &region) const {
+    return query(RectShape(region));
+}
+
+std::vector<std::shared_ptr<Particle>> QuadTree::range(const Rect &region, NType horizon) const {
+    QT_TRACE_SCOPE("QuadTree::range predictive");
+    if (!options->trackVelocity) {
+        throw std::runtime_error("Predictive queries require enableVelocityBounds()");
+    }
+    if (horizon < 0.0f) {
+        throw std::runtime_error("Predictive queries need a horizon >= 0");
+    }
+    std::vector<std::shared_ptr<Particle>> result;
+    rangeSearch(
+            root,
+            [&region, &horizon](const QuadNode &node) {
+                return node.getVelocityBounds().isValid() &&
+                       node.getSearchBounds().sweep(node.getVelocityBounds(), horizon).overlaps(region);
+            },
+            [&region, &horizon](const Particle &p) {
+                return region.intersectsSegment(p.getPosition(), p.getPosition() + p.getVelocity() * horizon);
+            },
+            result);
+    return result;
+}
+
+std::vector<std::shared_ptr<Particle>> QuadTree::radius(Point2D center, NType r) const {
+    return query(Circle(center, r));
+}
+
+template<typename NodeTest, typename ParticleTest>
+void QuadTree::rangeSearch(const std::shared_ptr<QuadNode> &node, NodeTest nodeTest, ParticleTest particleTest,
+                           std::vector<std::shared_ptr<Particle>> &result) const {
+    if (node->getCount() == 0 || !nodeTest(*node)) {
+        return;
+    }
+    if (node->isLeaf()) {
+        for (const std::shared_ptr<Particle> &p: node->getParticles()) {
+            if (particleTest(*p)) {
+                result.push_back(p);
+            }
+        }
+    } else {
+        for (const auto &child: node->getChildren()) {
+            rangeSearch(child, nodeTest, particleTest, result);
+        }
+    }
+}
+
+// Node is QuadNode or const QuadNode, as the caller needs
+template<typename Node>
+static void collectLeaves(Node *node, std::vector<Node *> &leaves) {
+    if (node->isLeaf()) {
+        leaves.push_back(node);
+        return;
+    }
+    for (const auto &child: node->getChildren()) {
+        collectLeaves<Node>(child.get(), leaves);
+    }
+}
+
+// Squared distances on raw floats, the join evaluates them far too often for NType
+static float squaredDistance(const Rect &rect, float x, float y) {
+    float dx = std::max({rect.getPmin().getX().getValue() - x, x - rect.getPmax().getX().getValue(), 0.0f});
+    float dy = std::max({rect.getPmin().getY().getValue() - y, y - rect.getPmax().getY().getValue(), 0.0f});
+    return dx * dx + dy * dy;
+}
+
+static float squaredDistance(const Rect &a, const Rect &b) {
+    float dx = std::max({a.getPmin().getX().getValue() - b.getPmax().getX().getValue(),
+                         b.getPmin().getX().getValue() - a.getPmax().getX().getValue(), 0.0f});
+    float dy = std::max({a.getPmin().getY().getValue() - b.getPmax().getY().getValue(),
+                         b.getPmin().getY().getValue() - a.getPmax().getY().getValue(), 0.0f});
+    return dx * dx + dy * dy;
+}
+
+// The k best (squared distance, particle) pairs seen so far, kept sorted by insertion
+class SmallTopK {
+private:
+    std::array<float, QuadTree::smallK> distances;
+    std::array<const std::shared_ptr<Particle> *, QuadTree::smallK> particles;
+    size_t k, size = 0;
+
+public:
+    explicit SmallTopK(size_t k) : k(k) {}
+
+    bool full() const { return size == k; }
+
+    // Anything further than this cannot enter once the buffer is full
+    float worst() const { return full() ? distances[k - 1] : std::numeric_limits<float>::infinity(); }
+
+    void push(float distance, const std::shared_ptr<Particle> *particle) {
+        size_t i = size;
+        if (full()) {
+            if (distance >= distances[k - 1]) return;
+            i = k - 1;
+        } else {
+            ++size;
+        }
+        for (; i > 0 && distances[i - 1] > distance; --i) {
+            distances[i] = distances[i - 1];
+            particles[i] = particles[i - 1];
+        }
+        distances[i] = distance;
+        particles[i] = particle;
+    }
+
+    void copyTo(std::vector<std::shared_ptr<Particle>> &result) const {
+        result.reserve(result.size() + size);
+        for (size_t i = 0; i < size; ++i) {
+            result.push_back(*particles[i]);
+        }
+    }
+};
+
+bool QuadTree::knnSmall(const Point2D &query, size_t k, std::vector<std::shared_ptr<Particle>> &result) const {
+    float qx = query.getX().getValue(), qy = query.getY().getValue();
+    SmallTopK topK(k);
+    // every expansion replaces one entry by at most four, so this covers trees about 80 levels deep
+    struct Entry {
+        float distance;
+        const QuadNode *node;
+    };
+    // left uninitialized, std::pair would zero all of it on every query
+    Entry frontier[256];
+    size_t frontierSize = 0;
+    if (root->getCount() > 0) {
+        frontier[frontierSize++] = {squaredDistance(root->getSearchBounds(), qx, qy), root.get()};
+    }
+    while (frontierSize > 0) {
+        auto [nodeDist, node] = frontier[--frontierSize];
+        if (nodeDist > topK.worst()) {
+            continue;
+        }
+        if (!node->isLeaf()) {
+            // sort the children by distance, then push the furthest first so the nearest is expanded next
+            Entry children[4];
+            size_t numChildren = 0;
+            for (const auto &child: node->getChildren()) {
+                if (child->getCount() == 0) {
+                    continue;
+                }
+                Entry entry{squaredDistance(child->getSearchBounds(), qx, qy), child.get()};
+                size_t i = numChildren++;
+                for (; i > 0 && children[i - 1].distance < entry.distance; --i) {
+                    children[i] = children[i - 1];
+                }
+                children[i] = entry;
+            }
+            if (frontierSize + numChildren > std::size(frontier)) {
+                return false;
+            }
+            for (size_t i = 0; i < numChildren; ++i) {
+                if (children[i].distance <= topK.worst()) {
+                    frontier[frontierSize++] = children[i];
+                }
+            }
+            continue;
+        }
+
+        const auto &leafParticles = node->getParticles();
+        for (size_t i = 0; i < leafParticles.size(); ++i) {
+            float dx = leafParticles[i]->getPosition().getX().getValue() - qx;
+            float dy = leafParticles[i]->getPosition().getY().getValue() - qy;
+            topK.push(dx * dx + dy * dy, &leafParticles[i]);
+        }
+    }
+    topK.copyTo(result);
+    return true;
+}
+
+std::vector<std::shared_ptr<Particle>> QuadTree::getParticles() const {
+    std::vector<const QuadNode *> leaves;
+    collectLeaves<const QuadNode>(root.get(), leaves);
+    std::vector<std::shared_ptr<Particle>> result;
+    for (const QuadNode *leaf: leaves) {
+        result.insert(result.end(), leaf->getParticles().begin(), leaf->getParticles().end());
+    }
+    return result;
+}
+
+std::vector<size_t> QuadTree::reorderParticles(std::vector<std::shared_ptr<Particle>> &particles) {
+    QT_TRACE_SCOPE("QuadTree::reorderParticles");
+    if (particles.size() != size()) {
+        throw std::runtime_error("reorderParticles: particles must hold exactly the indexed particles");
+    }
+    std::unordered_map<const Particle *, size_t> oldIndex;
+    oldIndex.reserve(particles.size());
+    for (size_t i = 0; i < particles.size(); ++i) {
+        oldIndex.emplace(particles[i].get(), i);
+    }
+
+    std::vector<QuadNode *> leaves;
+    collectLeaves(root.get(), leaves);
+    std::vector<std::shared_ptr<Particle>> reordered;
+    reordered.reserve(particles.size());
+    std::vector<size_t> remap(particles.size());
+    std::shared_ptr<std::vector<Particle>> block;
+    for (QuadNode *leaf: leaves) {
+        for (const auto &particle: leaf->getParticles()) {
+            auto found = oldIndex.find(particle.get());
+            if (found == oldIndex.end()) {
+                throw std::runtime_error("reorderParticles: the tree holds a particle missing from particles");
+            }
+            remap[found->second] = reordered.size();
+            // the leaf and particles own one reference each, anything more is a handle held elsewhere
+            if (particle.use_count() > 2) {
+                reordered.push_back(particle);
+                continue;
+            }
+            if (block == nullptr || block->size() == reorderBlockSize) {
+                block = std::make_shared<std::vector<Particle>>();
+                block->reserve(reorderBlockSize);
+            }
+            // aliasing pointers share ownership of their block, reserved so it never moves
+            block->push_back(*particle);
+            reordered.emplace_back(block, &block->back());
+        }
+    }
+    // fresh bucket arrays, allocated in the same order, follow the particles
+    size_t next = 0;
+    for (QuadNode *leaf: leaves) {
+        size_t n = leaf->getParticles().size();
+        leaf->replaceParticles({reordered.begin() + next, reordered.begin() + next + n});
+        next += n;
+    }
+    particles = std::move(reordered);
+    stepsSinceReorder = 0;
+    relocationsSinceReorder = 0;
+    return remap;
+}
+
+double QuadTree::scatter() const {
+    std::vector<std::shared_ptr<Particle>> ordered = getParticles();
+    if (ordered.size() < 2) {
+        return 0.0;
+    }
+    // shuffles inside a leaf or between neighboring leaves stay within a page and still count as local
+    const std::ptrdiff_t page = 4096;
+    size_t scattered = 0;
+    for (size_t i = 1; i < ordered.size(); ++i) {
+        std::ptrdiff_t gap = reinterpret_cast<const char *>(ordered[i].get()) -
+                             reinterpret_cast<const char *>(ordered[i - 1].get());
+        if (gap > page || gap < -page) {
+            ++scattered;
+        }
+    }
+    return static_cast<double>(scattered) / static_cast<double>(ordered.size() - 1);
+}
+
+std::vector<size_t> QuadTree::maybeReorder(std::vector<std::shared_ptr<Particle>> &particles, size_t interval,
+                                           double threshold) {
+    if (++stepsSinceReorder < interval &&
+        static_cast<double>(relocationsSinceReorder) <= threshold * static_cast<double>(size())) {
+        return {};
+    }
+    return reorderParticles(particles);
+}
+
+std::vector<size_t> QuadTree::allKnn(size_t k) const {
+    return knnJoin(*this, k);
+}
+
+std::vector<size_t> QuadTree::knnJoin(const QuadTree &other, size_t k) const {
+    QT_TRACE_SCOPE("QuadTree::knnJoin");
+    std::vector<const QuadNode *> queryLeaves, otherLeaves;
+    collectLeaves<const QuadNode>(root.get(), queryLeaves);
+    collectLeaves<const QuadNode>(other.root.get(), otherLeaves);
+
+    // first index of every leaf in the flat particle orders
+    std::vector<size_t> queryOffsets;
+    size_t numQueries = 0;
+    for (const QuadNode *leaf: queryLeaves) {
+        queryOffsets.push_back(numQueries);
+        numQueries += leaf->getParticles().size();
+    }
+    std::unordered_map<const QuadNode *, size_t> otherLeafOffsets;
+    size_t numOthers = 0;
+    for (const QuadNode *leaf: otherLeaves) {
+        otherLeafOffsets[leaf] = numOthers;
+        numOthers += leaf->getParticles().size();
+    }
+    if (k > numOthers) {
+        throw std::runtime_error("knnJoin: k is larger than the number of particles in the other tree");
+    }
+
+    std::vector<size_t> result(numQueries * k);
+    if (k == 0) {
+        return result;
+    }
+    // contiguous runs of leaves in depth-first order are whole subtrees, one run per thread
+    size_t numThreads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), queryLeaves.size()));
+    size_t leavesPerThread = (queryLeaves.size() + numThreads - 1) / numThreads;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < numThreads; ++t) {
+        size_t first = t * leavesPerThread, last = std::min(queryLeaves.size(), first + leavesPerThread);
+        workers.emplace_back([&, first, last]() {
+            QT_TRACE_SCOPE("QuadTree::knnJoin worker");
+            for (size_t i = first; i < last; ++i) {
+                knnJoinLeaf(*queryLeaves[i], k, *other.root, otherLeafOffsets, result.data() + queryOffsets[i] * k);
+            }
+        });
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    return result;
+}
+
+void QuadTree::knnJoinLeaf(const QuadNode &queryLeaf, size_t k, const QuadNode &otherRoot,
+                           const std::unordered_map<const QuadNode *, size_t> &otherLeafOffsets, size_t *out) {
+    const auto &queries = queryLeaf.getParticles();
+    if (queries.empty()) {
+        return;
+    }
+    std::vector<float> qx, qy;
+    Rect queryBounds = Rect::empty();
+    for (const auto &q: queries) {
+        qx.push_back(q->getPosition().getX().getValue());
+        qy.push_back(q->getPosition().getY().getValue());
+        queryBounds.extend(q->getPosition());
+    }
+
+    // one max-heap of (squared distance, index) per query particle
+    using Candidate = std::pair<float, size_t>;
+    std::vector<std::vector<Candidate>> heaps(queries.size());
+    for (auto &heap: heaps) {
+        heap.reserve(k);
+    }
+    // shared bound: no particle of the leaf can improve beyond the worst of its current k-th distances
+    float leafBound = std::numeric_limits<float>::infinity();
+    auto refreshLeafBound = [&]() {
+        leafBound = 0.0f;
+        for (const auto &heap: heaps) {
+            if (heap.size() < k) {
+                leafBound = std::numeric_limits<float>::infinity();
+                return;
+            }
+            leafBound = std::max(leafBound, heap.front().first);
+        }
+    };
+
+    std::vector<std::pair<float, const QuadNode *>> stack;
+    if (otherRoot.getCount() == 0) {
+        return;
+    }
+    stack.emplace_back(squaredDistance(otherRoot.getSearchBounds(), queryBounds), &otherRoot);
+    while (!stack.empty()) {
+        auto [nodeDist, node] = stack.back();
+        stack.pop_back();
+        if (nodeDist > leafBound) {
+            continue;
+        }
+        if (!node->isLeaf()) {
+            // push the furthest child first so the nearest one is expanded next
+            std::array<std::pair<float, const QuadNode *>, 4> children;
+            for (size_t c = 0; c < 4; ++c) {
+                const QuadNode *child = node->getChild(c).get();
+                float childDist = child->getCount() == 0 ? std::numeric_limits<float>::infinity()
+                                                         : squaredDistance(child->getSearchBounds(), queryBounds);
+                children[c] = {childDist, child};
+            }
+            std::sort(children.begin(), children.end(), std::greater<>());
+            for (const auto &child: children) {
+                if (child.first <= leafBound) {
+                    stack.push_back(child);
+                }
+            }
+            continue;
+        }
+
+        const auto &candidates = node->getParticles();
+        if (candidates.empty()) {
+            continue;
+        }
+        Rect nodeBounds = node->getSearchBounds();
+        size_t offset = otherLeafOffsets.at(node);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            auto &heap = heaps[i];
+            if (heap.size() == k && squaredDistance(nodeBounds, qx[i], qy[i]) > heap.front().first) {
+                continue;
+            }
+            for (size_t j = 0; j < candidates.size(); ++j) {
+                float dx = candidates[j]->getPosition().getX().getValue() - qx[i];
+                float dy = candidates[j]->getPosition().getY().getValue() - qy[i];
+                Candidate candidate(dx * dx + dy * dy, offset + j);
+                if (heap.size() < k) {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (candidate < heap.front()) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        }
+        refreshLeafBound();
+    }
+
+    for (size_t i = 0; i < queries.size(); ++i) {
+        std::sort_heap(heaps[i].begin(), heaps[i].end());
+        for (size_t j = 0; j < k; ++j) {
+            out[i * k + j] = heaps[i][j].second;
+        }
+    }
+}
+
+void QuadTree::enableQuantization(unsigned bits) {
+    if (!root->isLeaf() || !root->getParticles().empty()) {
+        throw std::runtime_error("Quantization must be enabled before inserting particles");
+    }
+    quantizer = std::make_shared<Quantizer>(root->getBoundary(), bits);
+    root->setQuantizer(quantizer.get());
+}
+
+void QuadTree::enableVelocityBounds() {
+    options->trackVelocity = true;
+    root->refreshVelocityBounds(true);
+}
+
+void QuadTree::enableContentBounds() {
+    options->trackContentBounds = true;
+    root->refreshContentBounds(true);
+}
+
+Rect QuadNode::getLooseBoundary() const {
+    if (options->looseFactor == 1.0f) {
+        return boundary;
+    }
+    return boundary.enlarge(options->looseFactor);
+}
+
+Rect QuadNode::getSearchBounds() const {
+    return options->trackContentBounds ? contentBounds : getLooseBoundary();
+}
+
 void QuadNode::subdivide() {
     auto splitRegions = boundary.split();
     std::shared_ptr<QuadNode> nw = std::make_shared<QuadNode>(splitRegions[0], this);
@@ -73,10 +636,51 @@ void QuadNode::subdivide() {
     children[1] = ne;
     children[2] = sw;
     children[3] = se;
+    if (quantizer != nullptr) {
+        nw->cell = {cell[0] * 2, cell[1] * 2 + 1};
+        ne->cell = {cell[0] * 2 + 1, cell[1] * 2 + 1};
+        sw->cell = {cell[0] * 2, cell[1] * 2};
+        se->cell = {cell[0] * 2 + 1, cell[1] * 2};
+    }
+}
+
+int QuadNode::findChild(const Point2D &position, const GridCode &code) const {
+    if (quantizer != nullptr) {
+        return static_cast<int>(quantizer->childIndex(code, depth));
+    }
+    // shared split edges match several children, keep the first one
+    for (size_t i = 0; i < children.size(); ++i) {
+        if (children[i]->boundary.contains(position)) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+bool QuadNode::owns(const Point2D &position, const GridCode &code) const {
+    // the grid clamps outside positions onto the edge cells, so those and the root check the boundary
+    if (quantizer != nullptr && parent != nullptr && quantizer->getDomain().contains(position)) {
+        return quantizer->cellAt(code, depth) == cell;
+    }
+    return boundary.contains(position);
+}
+
+bool QuadNode::insert(const std::shared_ptr<Particle> &particle, std::vector<std::shared_ptr<Particle>> *escaped) {
+    return insert(particle, gridCode(particle->getPosition()), escaped);
 }
 
-bool QuadNode::insert(const std::shared_ptr<Particle> &particle) {
-    if (_isLeaf && particles.size() >= QuadTree::bucketSize) {
+bool QuadNode::insert(const std::shared_ptr<Particle> &particle, const GridCode &code,
+                      std::vector<std::shared_ptr<Particle>> *escaped) {
+    ++count;
+    if (options->trackVelocity) {
+        velocityBounds.extend(particle->getVelocity());
+    }
+    if (options->trackContentBounds) {
+        contentBounds.extend(particle->getPosition());
+    }
+    // quantized cells cannot be split below one grid step
+    bool canSubdivide = quantizer == nullptr || depth < quantizer->getBits();
+    if (_isLeaf && particles.size() >= QuadTree::bucketSize && canSubdivide) {
         // add to particles but overflows
         addToBucket(particle);
 
@@ -90,30 +694,32 @@ bool QuadNode::insert(const std::shared_ptr<Particle> &particle) {
         _isLeaf = false;
 
         // insert the particles in the children
+        std::vector<std::shared_ptr<Particle>> outside;
         for (const std::shared_ptr<Particle> &childParticle: particlesCopy) {
-            bool didInsert = false;
-            for (const auto &child: children) {
-                if (child->boundary.contains(childParticle->getPosition())) {
-                    child->insert(childParticle);
-                    didInsert = true;
-                }
-            }
-            if (!didInsert) {
-                relocateParticle(childParticle);
+            // stale particles of a leaf that is being updated may already be outside
+            const Point2D &position = childParticle->getPosition();
+            GridCode childCode = gridCode(position);
+            int childIndex = owns(position, childCode) ? findChild(position, childCode) : -1;
+            if (childIndex >= 0) {
+                children[childIndex]->insert(childParticle, childCode, escaped);
+            } else {
+                outside.push_back(childParticle);
             }
         }
+        // only once the children are complete, relocation recomputes the bounds it passes through
+        for (const std::shared_ptr<Particle> &leaving: outside) {
+            --count;
+            relocateParticle(leaving, gridCode(leaving->getPosition()), escaped);
+        }
 
 
     } else if (!_isLeaf) {
-        bool didInsert = false;
-        for (const auto &child: children) {
-            if (child->boundary.contains(particle->getPosition())) {
-                child->insert(particle);
-                didInsert = true;
-            }
-        }
-        if (!didInsert) {
-            relocateParticle(particle);
+        int childIndex = findChild(particle->getPosition(), code);
+        if (childIndex >= 0) {
+            children[childIndex]->insert(particle, code, escaped);
+        } else {
+            --count;
+            relocateParticle(particle, code, escaped);
         }
     } else {
         // just add particle
@@ -122,40 +728,107 @@ bool QuadNode::insert(const std::shared_ptr<Particle> &particle) {
     return true;
 }
 
-void QuadNode::updateNode() {
+size_t QuadNode::updateNode(std::vector<std::shared_ptr<Particle>> *escaped) {
+    size_t relocated = 0;
     if (!_isLeaf) {
         // update children
         for (const auto &child: children) {
-            child->updateNode();
+            relocated += child->updateNode(escaped);
         }
     } else {
+        // in loose mode particles only migrate once they leave the enlarged cell, or the root
+        bool isLoose = options->looseFactor != 1.0f;
+        Rect looseBoundary = getLooseBoundary();
+        const QuadNode *root = this;
+        while (root->parent != nullptr) {
+            root = root->parent;
+        }
         for (size_t i = 0; i < particles.size(); ++i) {
             auto particle = particles[i];
-            if (!boundary.contains(particle->getPosition())) {
+            GridCode code = gridCode(particle->getPosition());
+            bool stays = isLoose ? looseBoundary.contains(particle->getPosition()) &&
+                                   root->boundary.contains(particle->getPosition())
+                                 : owns(particle->getPosition(), code);
+            if (!stays) {
                 // remove from leaf
                 particles.erase(particles.begin() + i);
+                --count;
+                ++relocated;
                 // relocate recursively
-                relocateParticle(particle);
+                relocateParticle(particle, code, escaped);
                 // might split
-                updateNode();
+                relocated += updateNode(escaped);
 
             }
         }
     }
 
+    // velocities change on bounces and particles move even when they stay in their leaf, children are
+    // already up to date
+    refreshBounds();
+    return relocated;
+}
 
+void QuadNode::refreshBounds() {
+    if (options->trackVelocity) {
+        refreshVelocityBounds(false);
+    }
+    if (options->trackContentBounds) {
+        refreshContentBounds(false);
+    }
+}
+
+void QuadNode::refreshVelocityBounds(bool recursive) {
+    velocityBounds = Rect::empty();
+    if (_isLeaf) {
+        for (const auto &particle: particles) {
+            velocityBounds.extend(particle->getVelocity());
+        }
+    } else {
+        for (const auto &child: children) {
+            if (recursive) {
+                child->refreshVelocityBounds(true);
+            }
+            velocityBounds.extend(child->velocityBounds);
+        }
+    }
+}
+
+void QuadNode::refreshContentBounds(bool recursive) {
+    contentBounds = Rect::empty();
+    if (_isLeaf) {
+        for (const auto &particle: particles) {
+            contentBounds.extend(particle->getPosition());
+        }
+    } else {
+        for (const auto &child: children) {
+            if (recursive) {
+                child->refreshContentBounds(true);
+            }
+            contentBounds.extend(child->contentBounds);
+        }
+    }
 }
 
 void QuadNode::addToBucket(const std::shared_ptr<Particle> &particle) {
     particles.push_back(particle);
 }
 
-void QuadNode::relocateParticle(const std::shared_ptr<Particle> &particle) {
-    // note: root always contains all particles
-    if (boundary.contains(particle->getPosition())) {
-        insert(particle);
+void QuadNode::relocateParticle(const std::shared_ptr<Particle> &particle, const GridCode &code,
+                                std::vector<std::shared_ptr<Particle>> *escaped) {
+    if (owns(particle->getPosition(), code)) {
+        insert(particle, code, escaped);
+    } else if (parent != nullptr) {
+        // the particle leaves the parent's subtree too until an ancestor takes it back
+        --parent->count;
+        // gone from this subtree, which may already have been updated in this pass
+        refreshBounds();
+        parent->relocateParticle(particle, code, escaped);
+    } else if (escaped != nullptr) {
+        escaped->push_back(particle);
     } else {
-        parent->relocateParticle(particle);
+        // root is expected to contain all particles
+        throw std::runtime_error("Particle left the root boundary");
     }
 }
 
@@ -173,4 +846,87 @@ void QuadNode::removeEmptyNode() {
     parent->removeEmptyNode();
 }
 
+KNNTracker::KNNTracker(const QuadTree &tree, size_t k) : tree(tree), k(k) {}
+
+void KNNTracker::reset() {
+    lastResult.clear();
+    lastLeaf.reset();
+}
+
+std::vector<std::shared_ptr<Particle>> KNNTracker::query(Point2D query) {
+    QT_TRACE_SCOPE("KNNTracker::query");
+    if (k == 0) {
+        return {};
+    }
+    // start from the previous leaf, climbing only as far as needed to contain the query
+    std::shared_ptr<QuadNode> node = lastLeaf.lock();
+    if (node == nullptr) {
+        node = tree.root;
+    }
+    while (!node->getBoundary().contains(query) && node->getParent() != nullptr) {
+        QuadNode *parent = node->getParent();
+        node = parent->getParent() == nullptr ? tree.root : owningPointer(parent);
+    }
+    while (!node->isLeaf()) {
+        std::shared_ptr<QuadNode> next = node->getChild(0);
+        for (const auto &child: node->getChildren()) {
+            if (child->getBoundary().contains(query)) {
+                next = child;
+                break;
+            }
+        }
+        node = next;
+    }
+    lastLeaf = node;
+
+    // the previous answer, at its new distances, gives a tight bound before any node is visited
+    QuadTree::KNNMaxHeap maxHeap;
+    for (const auto &p: lastResult) {
+        maxHeap.emplace(p, query.distance(p->getPosition()).getValue());
+    }
+    auto nodeDistance = [&query](const QuadNode &n) { return n.getSearchBounds().distance(query).getValue(); };
+    auto particleDistance = [&query, this](const Particle &p) {
+        for (const auto &seeded: lastResult) {
+            if (seeded.get() == &p) {
+                return std::numeric_limits<float>::infinity();
+            }
+        }
+        return query.distance(p.getPosition()).getValue();
+    };
+
+    // search outward: the leaf, then the siblings of every ancestor up to the root
+    QuadTree::knnSearchFrom(node, k, nodeDistance, particleDistance, maxHeap);
+    for (QuadNode *visited = node.get(); visited->getParent() != nullptr; visited = visited->getParent()) {
+        QuadNode *ancestor = visited->getParent();
+        for (const auto &sibling: ancestor->getChildren()) {
+            if (sibling.get() == visited || sibling->getCount() == 0) {
+                continue;
+            }
+            if (maxHeap.size() < k || nodeDistance(*sibling) <= maxHeap.top().distToQuery) {
+                QuadTree::knnSearchFrom(sibling, k, nodeDistance, particleDistance, maxHeap);
+            }
+        }
+        // with exact cells nothing outside the ancestor can beat a k-th distance that fits inside it
+        if (tree.options->looseFactor == 1.0f && maxHeap.size() == k) {
+            const Rect &cell = ancestor->getBoundary();
+            NType margin = NType::min(
+                    NType::min(query.getX() - cell.getPmin().getX(), cell.getPmax().getX() - query.getX()),
+                    NType::min(query.getY() - cell.getPmin().getY(), cell.getPmax().getY() - query.getY()));
+            if (NType(maxHeap.top().distToQuery) < margin) {
+                break;
+            }
+        }
+    }
+
+    lastResult = QuadTree::extractKnn(maxHeap);
+    return lastResult;
+}
 
+std::shared_ptr<QuadNode> KNNTracker::owningPointer(QuadNode *node) {
+    for (const auto &sibling: node->getParent()->getChildren()) {
+        if (sibling.get() == node) {
+            return sibling;
+        }
+    }
+    return nullptr;
+}
@@ -3,19 +3,46 @@
 
 #include "Particle.h"
 #include "Rect.h"
+#include "Quantizer.h"
+#include "Shapes.h"
+#include "Trace.h"
 #include <vector>
 #include <memory>
 #include <array>
+#include <unordered_map>
+#include <queue>
 
 //class QuadTree;
 
+// Settings of one tree, owned by the QuadTree and reached by every node through a pointer inherited on
+// subdivide, so trees with different settings can live side by side
+struct QuadTreeOptions {
+    // 1 means exact cells, > 1 enables the loose quadtree mode
+    NType looseFactor = 1.0f;
+    // Nodes maintain velocity bounds for predictive queries, see QuadTree::enableVelocityBounds()
+    bool trackVelocity = false;
+    // Nodes maintain the tight bounds of their contents, see QuadTree::enableContentBounds()
+    bool trackContentBounds = false;
+
+    // What nodes built outside a QuadTree use
+    static const QuadTreeOptions defaults;
+};
+
 class QuadNode {
 private:
     std::vector<std::shared_ptr<Particle>> particles;
     std::array<std::shared_ptr<QuadNode>, 4> children; // NW, NE, SW, SE
     Rect boundary;
+    Rect velocityBounds; // min/max (vx, vy) of the subtree, kept when the tree tracks velocities
+    Rect contentBounds; // tight bounds of the subtree's positions, kept when the tree tracks content bounds
     QuadNode *parent;
+    size_t count = 0; // particles in the subtree
     bool _isLeaf;
+    const QuadTreeOptions *options;
+    // Quantized mode, shared with the whole tree; cell is the node's position in the grid at its depth
+    const Quantizer *quantizer;
+    unsigned depth;
+    std::array<uint32_t, 2> cell;
 
     void addToBucket(const std::shared_ptr<Particle> &particle);
 
@@ -23,22 +50,56 @@ private:
 
     void subdivide();
 
-    void relocateParticle(const std::shared_ptr<Particle> &particle);
+    // Quantized position, computed once per descent and handed down; all zero without a quantizer
+    using GridCode = std::array<uint32_t, 2>;
+
+    GridCode gridCode(const Point2D &position) const {
+        return quantizer != nullptr ? quantizer->quantize(position) : GridCode{0, 0};
+    }
+
+    bool insert(const std::shared_ptr<Particle> &particle, const GridCode &code,
+                std::vector<std::shared_ptr<Particle>> *escaped);
+
+    // Particles that leave the root go to escaped when given, otherwise that is an error
+    void relocateParticle(const std::shared_ptr<Particle> &particle, const GridCode &code,
+                          std::vector<std::shared_ptr<Particle>> *escaped);
+
+    // Index of the child that takes position, -1 if none does
+    int findChild(const Point2D &position, const GridCode &code) const;
+
+    // Exact cell membership: grid prefix in quantized mode, boundary.contains otherwise
+    bool owns(const Point2D &position, const GridCode &code) const;
 
     void removeEmptyNode();
 
+    // Recompute the tracked bounds of this node from its particles or children
+    void refreshBounds();
+
 //    bool insert(std::shared_ptr<QuadNode> node, const std::shared_ptr<Particle> &p);
 
 public:
     QuadNode(NType xmin, NType ymin, NType xmax, NType ymax, QuadNode *parent = nullptr)
-            : boundary(Point2D(xmin, ymin), Point2D(xmax, ymax)), parent(parent), _isLeaf(true) {}
+            : boundary(Point2D(xmin, ymin), Point2D(xmax, ymax)), velocityBounds(Rect::empty()),
+              contentBounds(Rect::empty()), parent(parent), _isLeaf(true),
+              options(parent ? parent->options : &QuadTreeOptions::defaults),
+              quantizer(parent ? parent->quantizer : nullptr), depth(parent ? parent->depth + 1 : 0), cell{0, 0} {}
 
     explicit QuadNode(const Rect &boundary, QuadNode *parent = nullptr)
-            : boundary(boundary), parent(parent), _isLeaf(true) {}
+            : boundary(boundary), velocityBounds(Rect::empty()), contentBounds(Rect::empty()), parent(parent),
+              _isLeaf(true), options(parent ? parent->options : &QuadTreeOptions::defaults),
+              quantizer(parent ? parent->quantizer : nullptr), depth(parent ? parent->depth + 1 : 0), cell{0, 0} {}
+
+    // escaped as in relocateParticle, a split during updateNode re-inserts particles that already moved
+    bool insert(const std::shared_ptr<Particle> &particle, std::vector<std::shared_ptr<Particle>> *escaped = nullptr);
+
+    // Returns how many particles left their leaf
+    size_t updateNode(std::vector<std::shared_ptr<Particle>> *escaped = nullptr);
 
-    bool insert(const std::shared_ptr<Particle> &particle);
+    // Recompute velocityBounds from the particles (leaf) or the children (internal)
+    void refreshVelocityBounds(bool recursive);
 
-    void updateNode();
+    // Recompute contentBounds the same way
+    void refreshContentBounds(bool recursive);
 
     // Getters
     const std::vector<std::shared_ptr<Particle>> &getParticles() const { return particles; }
@@ -48,12 +109,36 @@ public:
     const std::array<std::shared_ptr<QuadNode>, 4> &getChildren() const { return children; }
 
     const Rect &getBoundary() const { return boundary; }
-//    const QuadNode* getParent() const { return parent; }
+
+    size_t getCount() const { return count; }
+
+    // Boundary enlarged by the tree's loose factor; particles stay in the leaf until they leave it
+    Rect getLooseBoundary() const;
+
+    // Invalid (see Rect::isValid) while the subtree holds no particles
+    const Rect &getVelocityBounds() const { return velocityBounds; }
+
+    // Invalid while the subtree holds no particles
+    const Rect &getContentBounds() const { return contentBounds; }
+
+    // What queries prune on: the content bounds when they are tracked, the loose boundary otherwise.
+    // Only meaningful for a non-empty subtree.
+    Rect getSearchBounds() const;
+
+    QuadNode *getParent() const { return parent; }
 
     // Setters
 //    void setParent(std::shared_ptr<QuadNode> parent);
     void clearParticles() { particles.clear(); }
 
+    // Other objects for the same particles in the same order, so the bounds stay valid
+    void replaceParticles(std::vector<std::shared_ptr<Particle>> replacement) { particles = std::move(replacement); }
+
+    // Only meaningful on an empty root, children inherit them on subdivide
+    void setOptions(const QuadTreeOptions *options) { this->options = options; }
+
+    void setQuantizer(const Quantizer *quantizer) { this->quantizer = quantizer; }
+
     bool isLeaf() const { return _isLeaf; }
 };
 
@@ -61,13 +146,20 @@ public:
 class QuadTree {
 private:
     std::shared_ptr<QuadNode> root;
+    std::shared_ptr<QuadTreeOptions> options = std::make_shared<QuadTreeOptions>();
+    std::shared_ptr<Quantizer> quantizer;
+    size_t stepsSinceReorder = 0;
+    // particles inserted or moved to another leaf since the last reorder, kept by insert and updateTree
+    size_t relocationsSinceReorder = 0;
 
     struct KNNTreePair {
         KNNTreePair(std::shared_ptr<QuadNode> _node, Point2D _query) {
             node = _node;
-            distToQuery = node->getBoundary().distance(_query).getValue();
+            distToQuery = node->getSearchBounds().distance(_query).getValue();
         }
 
+        KNNTreePair(std::shared_ptr<QuadNode> _node, float _distToQuery) : distToQuery(_distToQuery), node(_node) {}
+
         float distToQuery;
         std::shared_ptr<QuadNode> node;
 
@@ -93,6 +185,9 @@ private:
             distToQuery = query.distance(particle->getPosition()).getValue();
         }
 
+        KNNParticlePair(std::shared_ptr<Particle> particle, float distToQuery)
+                : distToQuery(distToQuery), particle(particle) {}
+
         float distToQuery;
         std::shared_ptr<Particle> particle;
 
@@ -113,33 +208,265 @@ private:
         }
     };
 
+    using KNNMaxHeap = std::priority_queue<KNNParticlePair, std::vector<KNNParticlePair>, std::less<>>;
+
+    template<typename NodeDistance, typename ParticleDistance>
+    std::vector<std::shared_ptr<Particle>>
+    knnSearch(size_t k, NodeDistance nodeDistance, ParticleDistance particleDistance) const;
+
+    // Best-first search of the subtree at start, merging into the k entries already in maxHeap
+    template<typename NodeDistance, typename ParticleDistance>
+    static void knnSearchFrom(const std::shared_ptr<QuadNode> &start, size_t k, NodeDistance nodeDistance,
+                              ParticleDistance particleDistance, KNNMaxHeap &maxHeap);
+
+    // Nearest first
+    static std::vector<std::shared_ptr<Particle>> extractKnn(KNNMaxHeap &maxHeap);
+
+    // k-NN for k <= smallK on squared float distances, with a sorted fixed-size result buffer and a
+    // depth-first frontier on the stack that expands children nearest first. The search itself does not
+    // touch the heap; result is reserved once for the answer. Returns false, leaving result untouched,
+    // if the frontier would overflow.
+    bool knnSmall(const Point2D &query, size_t k, std::vector<std::shared_ptr<Particle>> &result) const;
+
+    friend class KNNTracker;
+
+    static void knnJoinLeaf(const QuadNode &queryLeaf, size_t k, const QuadNode &otherRoot,
+                            const std::unordered_map<const QuadNode *, size_t> &otherLeafOffsets, size_t *out);
+
+    // Every particle of the subtree, without testing them
+    static void collectSubtree(const QuadNode &node, std::vector<std::shared_ptr<Particle>> &result);
+
+    template<typename Shape>
+    static void queryNode(const QuadNode &node, const Shape &shape, std::vector<std::shared_ptr<Particle>> &result);
+
+    template<typename Shape>
+    static size_t countNode(const QuadNode &node, const Shape &shape);
+
+    template<typename Column, typename Row>
+    static void densityGrid(const QuadNode &node, std::vector<size_t> &grid, size_t cols, Column column, Row row);
+
+    template<typename NodeTest, typename ParticleTest>
+    void rangeSearch(const std::shared_ptr<QuadNode> &node, NodeTest nodeTest, ParticleTest particleTest,
+                     std::vector<std::shared_ptr<Particle>> &result) const;
+
 public:
     static size_t bucketSize;
+    // Largest k served by the small-k k-NN path
+    static constexpr size_t smallK = 32;
+    // Particles per block allocated by reorderParticles
+    static constexpr size_t reorderBlockSize = 1024;
 
     // Constructors
     QuadTree(NType xmin, NType ymin, NType xmax, NType ymax, size_t bucketSize)
             : root(std::make_shared<QuadNode>(Rect(Point2D(xmin, ymin), Point2D(xmax, ymax)))) {
         QuadTree::bucketSize = bucketSize;
+        root->setOptions(options.get());
     }
 
     QuadTree(const Rect &boundary, size_t bucketSize)
             : root(std::make_shared<QuadNode>(boundary)) {
         QuadTree::bucketSize = bucketSize;
+        root->setOptions(options.get());
+    }
+
+    QuadTree(const Rect &boundary, size_t bucketSize, NType looseFactor)
+            : root(std::make_shared<QuadNode>(boundary)) {
+        if (looseFactor < 1.0f) {
+            throw std::runtime_error("Loose factor must be >= 1");
+        }
+        QuadTree::bucketSize = bucketSize;
+        options->looseFactor = looseFactor;
+        root->setOptions(options.get());
     }
 
     QuadTree(NType xmin, NType ymin, NType xmax, NType ymax)
-            : root(std::make_shared<QuadNode>(Rect(Point2D(xmin, ymin), Point2D(xmax, ymax)))) {}
+            : root(std::make_shared<QuadNode>(Rect(Point2D(xmin, ymin), Point2D(xmax, ymax)))) {
+        root->setOptions(options.get());
+    }
 
     QuadTree(const Rect &boundary)
-            : root(std::make_shared<QuadNode>(boundary)) {}
+            : root(std::make_shared<QuadNode>(boundary)) {
+        root->setOptions(options.get());
+    }
 
     void insert(const std::vector<std::shared_ptr<Particle>> &particles);
 
     const std::shared_ptr<QuadNode> &getRoot() const;
 
+    const QuadTreeOptions &getOptions() const { return *options; }
+
     std::vector<std::shared_ptr<Particle>> knn(Point2D query, size_t k);
 
+    // k nearest particles to query at time horizon >= 0, assuming straight motion at the current velocity
+    std::vector<std::shared_ptr<Particle>> knn(Point2D query, size_t k, NType horizon) const;
+
+    std::vector<std::shared_ptr<Particle>> range(const Rect &region) const;
+
+    size_t size() const;
+
+    // Number of particles in region; subtrees fully inside it are counted without visiting their leaves
+    size_t countInRect(const Rect &region) const;
+
+    // Particle counts over a rows x cols grid covering the root boundary, row-major from the minimum
+    // corner, in one traversal
+    std::vector<size_t> densityGrid(size_t rows, size_t cols) const;
+
+    // Particles within distance r of center
+    std::vector<std::shared_ptr<Particle>> radius(Point2D center, NType r) const;
+
+    // Particles inside shape, any type with the interface described in Shapes.h. Traversal is instantiated
+    // per shape type, and subtrees the shape fully contains are taken without testing their particles.
+    template<typename Shape>
+    std::vector<std::shared_ptr<Particle>> query(const Shape &shape) const;
+
+    // Number of particles inside shape, subtrees it fully contains are counted without visiting them
+    template<typename Shape>
+    size_t count(const Shape &shape) const;
+
+    // Particles whose straight path during [0, horizon] passes through region, horizon >= 0
+    std::vector<std::shared_ptr<Particle>> range(const Rect &region, NType horizon) const;
+
+    // Particles in leaf depth-first order; this is the index space used by allKnn and knnJoin
+    std::vector<std::shared_ptr<Particle>> getParticles() const;
+
+    // Copies the particles into contiguous blocks of reorderBlockSize in leaf depth-first order, which
+    // is the Z-order curve of the tree, and points the leaves at the copies. A pointer that outlives
+    // the tree pins one block, not all of them. A particle referenced by anything other than its leaf
+    // and the particles argument (use_count > 2), e.g. a KNNTracker result or another tree, is not
+    // copied, so that reference stays current. reorderParticles is therefore a no-op when the caller
+    // passes a copy of its particle vector, or when another tree indexes the same particles.
+    // particles must hold exactly the indexed particles and comes back in the new order; the result
+    // maps old index -> new index so arrays indexed by particle can follow.
+    std::vector<size_t> reorderParticles(std::vector<std::shared_ptr<Particle>> &particles);
+
+    // Fraction of particles, in leaf depth-first order, stored more than a page away from their
+    // predecessor: close to 0 right after reorderParticles, close to 1 for scattered allocations.
+    // Walks every leaf, so it is meant for diagnostics rather than per step.
+    double scatter() const;
+
+    // Call once per step: reorders when interval steps have passed since the last reorder or once the
+    // particles inserted or moved to another leaf since then exceed threshold * size(). Returns the
+    // remap table, empty if nothing was done.
+    std::vector<size_t> maybeReorder(std::vector<std::shared_ptr<Particle>> &particles, size_t interval,
+                                     double threshold);
+
+    // Row i of the flat n x k result lists, nearest first, the indices in other.getParticles() of the
+    // k nearest neighbors of getParticles()[i]. This is a per-leaf batched join, not a dual-tree
+    // traversal: every query leaf walks the other tree on its own with one pruning bound shared by its
+    // particles. Sibling leaves share nothing and query-side internal nodes are never pruned. Runs of
+    // query leaves are processed in parallel.
+    std::vector<size_t> knnJoin(const QuadTree &other, size_t k) const;
+
+    // knnJoin against this tree. Each particle finds itself at distance 0, normally as its first
+    // neighbor (a coincident particle may come first), so SPH and clustering callers must skip it.
+    std::vector<size_t> allKnn(size_t k) const;
+
+    // Quantize positions relative to the root boundary on a 2^bits grid (16 or 32 are the usual choices).
+    // Descent then reads child indices from the coordinate bits, so a particle on a split edge lands in
+    // exactly one child, and the tree is at most bits levels deep. Must be called on an empty tree.
+    // Particles keep their float positions; the grid only drives descent and cell membership, so memory
+    // per particle does not change. CompactQuadTree stores 16-bit positions for read-mostly sets.
+    void enableQuantization(unsigned bits);
+
+    // Starts maintaining per-node velocity bounds, required by the predictive queries
+    void enableVelocityBounds();
+
+    // Starts maintaining per-node content bounds. Queries then prune on where the particles of a node
+    // actually are instead of its whole cell, which pays off on clustered data. updateTree() refreshes them.
+    void enableContentBounds();
+
     void updateTree();
+
+    // Like updateTree(), but particles that moved outside the root boundary are removed from the tree
+    // and appended to escaped instead of being an error
+    void updateTree(std::vector<std::shared_ptr<Particle>> &escaped);
 };
 
+// Stateful k-NN for a point that moves a little between frames. Each query is seeded with the previous
+// answer at its updated distances and searches outward from the previous leaf through parent pointers,
+// so steady-state cost is close to a few leaf scans. The previous answer must still be indexed in the tree.
+class KNNTracker {
+private:
+    const QuadTree &tree;
+    size_t k;
+    std::vector<std::shared_ptr<Particle>> lastResult;
+    std::weak_ptr<QuadNode> lastLeaf;
+
+    static std::shared_ptr<QuadNode> owningPointer(QuadNode *node);
+
+public:
+    KNNTracker(const QuadTree &tree, size_t k);
+
+    std::vector<std::shared_ptr<Particle>> query(Point2D query);
+
+    // Forget the previous answer, e.g. after the tracked point jumps
+    void reset();
+};
+
+template<typename Shape>
+std::vector<std::shared_ptr<Particle>> QuadTree::query(const Shape &shape) const {
+    QT_TRACE_SCOPE("QuadTree::query");
+    std::vector<std::shared_ptr<Particle>> result;
+    queryNode(*root, shape, result);
+    return result;
+}
+
+template<typename Shape>
+size_t QuadTree::count(const Shape &shape) const {
+    QT_TRACE_SCOPE("QuadTree::count");
+    return countNode(*root, shape);
+}
+
+template<typename Shape>
+void QuadTree::queryNode(const QuadNode &node, const Shape &shape, std::vector<std::shared_ptr<Particle>> &result) {
+    if (node.getCount() == 0) {
+        return;
+    }
+    Rect bounds = node.getSearchBounds();
+    if (!shape.overlaps(bounds)) {
+        return;
+    }
+    if (shape.contains(bounds)) {
+        collectSubtree(node, result);
+    } else if (node.isLeaf()) {
+        for (const std::shared_ptr<Particle> &p: node.getParticles()) {
+            if (shape.contains(p->getPosition())) {
+                result.push_back(p);
+            }
+        }
+    } else {
+        for (const auto &child: node.getChildren()) {
+            queryNode(*child, shape, result);
+        }
+    }
+}
+
+template<typename Shape>
+size_t QuadTree::countNode(const QuadNode &node, const Shape &shape) {
+    if (node.getCount() == 0) {
+        return 0;
+    }
+    Rect bounds = node.getSearchBounds();
+    if (!shape.overlaps(bounds)) {
+        return 0;
+    }
+    if (shape.contains(bounds)) {
+        // the whole subtree is inside, no need to look at its particles
+        return node.getCount();
+    }
+    size_t total = 0;
+    if (node.isLeaf()) {
+        for (const auto &particle: node.getParticles()) {
+            if (shape.contains(particle->getPosition())) {
+                ++total;
+            }
+        }
+    } else {
+        for (const auto &child: node.getChildren()) {
+            total += countNode(*child, shape);
+        }
+    }
+    return total;
+}
+
 #endif // QUADTREE_H
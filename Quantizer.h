@@ -0,0 +1,63 @@
+#ifndef QUANTIZER_H
+#define QUANTIZER_H
+
+#include "Rect.h"
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+
+// Maps positions inside a domain to a 2^bits x 2^bits integer grid. Cell boundaries of a quadtree
+// rooted at the domain are exactly the grid lines at power of two steps, so the child of a node at a
+// given depth is read from one bit of each coordinate.
+class Quantizer {
+private:
+    Rect domain;
+    unsigned bits;
+    double scaleX, scaleY;
+    uint64_t maxCode;
+
+    uint32_t quantizeAxis(float value, float min, double scale) const {
+        // double keeps the float input exact, so the grid agrees with the split points of Rect::split
+        double scaled = (static_cast<double>(value) - min) * scale;
+        // clamp before converting, a far outside value does not fit the integer type (NaN goes to 0)
+        if (!(scaled > 0.0)) return 0;
+        if (scaled >= static_cast<double>(maxCode)) return static_cast<uint32_t>(maxCode);
+        return static_cast<uint32_t>(scaled);
+    }
+
+public:
+    Quantizer(const Rect &domain, unsigned bits) : domain(domain), bits(bits) {
+        if (bits == 0 || bits > 32) {
+            throw std::runtime_error("Quantization must use between 1 and 32 bits");
+        }
+        double cells = static_cast<double>(uint64_t(1) << bits);
+        scaleX = cells / (domain.getPmax().getX() - domain.getPmin().getX()).getValue();
+        scaleY = cells / (domain.getPmax().getY() - domain.getPmin().getY()).getValue();
+        maxCode = (uint64_t(1) << bits) - 1;
+    }
+
+    unsigned getBits() const { return bits; }
+
+    const Rect &getDomain() const { return domain; }
+
+    std::array<uint32_t, 2> quantize(const Point2D &p) const {
+        return {quantizeAxis(p.getX().getValue(), domain.getPmin().getX().getValue(), scaleX),
+                quantizeAxis(p.getY().getValue(), domain.getPmin().getY().getValue(), scaleY)};
+    }
+
+    // Index (NW, NE, SW, SE) of the child of a node at depth that holds code
+    size_t childIndex(const std::array<uint32_t, 2> &code, unsigned depth) const {
+        unsigned shift = bits - 1 - depth;
+        size_t east = (code[0] >> shift) & 1u;
+        size_t south = ((code[1] >> shift) & 1u) ^ 1u;
+        return (south << 1) | east;
+    }
+
+    // Grid coordinates of the depth-level cell holding code
+    std::array<uint32_t, 2> cellAt(const std::array<uint32_t, 2> &code, unsigned depth) const {
+        unsigned shift = bits - depth;
+        return {static_cast<uint32_t>(uint64_t(code[0]) >> shift), static_cast<uint32_t>(uint64_t(code[1]) >> shift)};
+    }
+};
+
+#endif // QUANTIZER_H
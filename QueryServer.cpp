@@ -0,0 +1,201 @@
+#include "QueryServer.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static sockaddr_un socketAddress(const std::string &path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return address;
+}
+
+static bool writeAll(int fd, const std::string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        // a peer that went away must not raise SIGPIPE in the whole process
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Reads up to the next newline, keeping whatever follows in buffer
+static bool readLine(int fd, std::string &buffer, std::string &line) {
+    size_t newline;
+    while ((newline = buffer.find('\n')) == std::string::npos) {
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+    line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+    return true;
+}
+
+QueryServer::QueryServer(QueryService &service, const std::string &socketPath)
+        : service(service), socketPath(socketPath) {
+    sockaddr_un address = socketAddress(socketPath);
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        throw std::runtime_error("Cannot create socket");
+    }
+    unlink(socketPath.c_str());
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listenFd, 128) < 0) {
+        close(listenFd);
+        throw std::runtime_error("Cannot listen on " + socketPath);
+    }
+    acceptor = std::thread(&QueryServer::acceptLoop, this);
+}
+
+QueryServer::~QueryServer() {
+    stopping = true;
+    // wakes accept() and every blocked read()
+    shutdown(listenFd, SHUT_RDWR);
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (Connection &connection: connections) {
+            shutdown(connection.fd, SHUT_RDWR);
+        }
+    }
+    acceptor.join();
+    for (Connection &connection: connections) {
+        connection.thread.join();
+        close(connection.fd);
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+}
+
+void QueryServer::acceptLoop() {
+    int backoffMs = 1;
+    while (!stopping) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) {
+                // the listening socket is shut down or broken
+                break;
+            }
+            // out of descriptors or memory: free what finished connections hold and retry later
+            reapConnections();
+            std::this_thread::sleep_for(std::chrono::milliseconds(backoffMs));
+            backoffMs = std::min(backoffMs * 2, 100);
+            continue;
+        }
+        backoffMs = 1;
+        reapConnections();
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        if (stopping) {
+            close(fd);
+            break;
+        }
+        Connection &connection = connections.emplace_back();
+        connection.fd = fd;
+        connection.thread = std::thread(&QueryServer::serve, this, std::ref(connection));
+    }
+}
+
+void QueryServer::reapConnections() {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    for (auto it = connections.begin(); it != connections.end();) {
+        if (it->finished) {
+            it->thread.join();
+            close(it->fd);
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void QueryServer::serve(Connection &connection) {
+    std::string buffer, line;
+    while (!stopping && readLine(connection.fd, buffer, line)) {
+        std::string reply;
+        try {
+            reply = handle(line);
+        } catch (const std::exception &error) {
+            reply = std::string("error ") + error.what();
+        }
+        if (!writeAll(connection.fd, reply + "\n")) {
+            break;
+        }
+    }
+    // the descriptor is closed by whoever joins this thread
+    shutdown(connection.fd, SHUT_RDWR);
+    connection.finished = true;
+}
+
+std::string QueryServer::handle(const std::string &line) {
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+    QueryService::Result particles;
+    if (command == "knn") {
+        float x, y;
+        size_t k;
+        if (!(in >> x >> y >> k)) {
+            return "error expected: knn <x> <y> <k>";
+        }
+        particles = service.knn(Point2D(x, y), k).get();
+    } else if (command == "range") {
+        float xmin, ymin, xmax, ymax;
+        if (!(in >> xmin >> ymin >> xmax >> ymax)) {
+            return "error expected: range <xmin> <ymin> <xmax> <ymax>";
+        }
+        particles = service.range(Rect(Point2D(xmin, ymin), Point2D(xmax, ymax))).get();
+    } else {
+        return "error unknown command " + command;
+    }
+
+    std::ostringstream out;
+    // enough digits for the coordinates to read back as the same floats
+    out << std::setprecision(std::numeric_limits<float>::max_digits10) << particles.size();
+    for (const auto &particle: particles) {
+        out << ' ' << particle->getPosition().getX() << ' ' << particle->getPosition().getY();
+    }
+    return out.str();
+}
+
+QueryClient::QueryClient(const std::string &socketPath) {
+    sockaddr_un address = socketAddress(socketPath);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw std::runtime_error("Cannot connect to " + socketPath);
+    }
+}
+
+QueryClient::~QueryClient() {
+    close(fd);
+}
+
+std::string QueryClient::request(const std::string &line) {
+    std::string reply;
+    if (!writeAll(fd, line + "\n") || !readLine(fd, buffer, reply)) {
+        throw std::runtime_error("Connection closed");
+    }
+    return reply;
+}
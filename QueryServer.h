@@ -0,0 +1,71 @@
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+
+#include "QueryService.h"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Line protocol over a UNIX domain socket in front of a QueryService, one thread per connection.
+// Requests:  "knn <x> <y> <k>"  or  "range <xmin> <ymin> <xmax> <ymax>"
+// Replies:   "<n> <x1> <y1> ... <xn> <yn>"  or  "error <message>"
+class QueryServer {
+private:
+    QueryService &service;
+    std::string socketPath;
+    int listenFd = -1;
+    std::atomic<bool> stopping{false};
+    std::thread acceptor;
+    struct Connection {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> finished{false};
+    };
+
+    std::mutex connectionsMutex;
+    // finished connections are joined and closed by the next accept, the rest by the destructor
+    std::list<Connection> connections;
+
+    void acceptLoop();
+
+    void reapConnections();
+
+    void serve(Connection &connection);
+
+    std::string handle(const std::string &line);
+
+public:
+    QueryServer(QueryService &service, const std::string &socketPath);
+
+    // Closes the listening socket and every open connection
+    ~QueryServer();
+
+    QueryServer(const QueryServer &) = delete;
+
+    QueryServer &operator=(const QueryServer &) = delete;
+
+    const std::string &getSocketPath() const { return socketPath; }
+};
+
+// Blocking client for the protocol above, used by the load generator
+class QueryClient {
+private:
+    int fd = -1;
+    std::string buffer;
+
+public:
+    explicit QueryClient(const std::string &socketPath);
+
+    ~QueryClient();
+
+    QueryClient(const QueryClient &) = delete;
+
+    QueryClient &operator=(const QueryClient &) = delete;
+
+    // Sends one request line and returns the reply line
+    std::string request(const std::string &line);
+};
+
+#endif // QUERYSERVER_H
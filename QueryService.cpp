@@ -0,0 +1,143 @@
+#include "QueryService.h"
+#include "Morton.h"
+#include "Trace.h"
+#include <algorithm>
+
+// Completes a future from the service callback
+static QueryService::Callback fulfil(const std::shared_ptr<std::promise<QueryService::Result>> &promise) {
+    return [promise](QueryService::Result particles, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(std::move(particles));
+        }
+    };
+}
+
+QueryService::QueryService(QuadTree &tree, size_t numWorkers, size_t maxBatch)
+        : tree(tree), quantizer(tree.getRoot()->getBoundary(), 16), maxBatch(std::max<size_t>(maxBatch, 1)) {
+    for (size_t i = 0; i < std::max<size_t>(numWorkers, 1); ++i) {
+        workers.emplace_back(&QueryService::workerLoop, this);
+    }
+}
+
+QueryService::~QueryService() {
+    {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+std::future<QueryService::Result> QueryService::knn(Point2D query, size_t k) {
+    auto promise = std::make_shared<std::promise<Result>>();
+    std::future<Result> result = promise->get_future();
+    knn(query, k, fulfil(promise));
+    return result;
+}
+
+std::future<QueryService::Result> QueryService::range(const Rect &region) {
+    auto promise = std::make_shared<std::promise<Result>>();
+    std::future<Result> result = promise->get_future();
+    range(region, fulfil(promise));
+    return result;
+}
+
+void QueryService::knn(Point2D query, size_t k, Callback done) {
+    submit(new Request{Request::KNN, query, k, Rect(), std::move(done), mortonEncode(quantizer, query), nullptr});
+}
+
+void QueryService::range(const Rect &region, Callback done) {
+    submit(new Request{Request::RANGE, region.getCenter(), 0, region, std::move(done),
+                       mortonEncode(quantizer, region.getCenter()), nullptr});
+}
+
+void QueryService::update(const std::function<void(QuadTree &)> &mutation) {
+    std::unique_lock<std::shared_mutex> lock(treeMutex);
+    mutation(tree);
+}
+
+void QueryService::submit(Request *request) {
+    pushList(request, request);
+}
+
+void QueryService::pushList(Request *first, Request *last) {
+    Request *head = pending.load(std::memory_order_relaxed);
+    do {
+        last->next = head;
+    } while (!pending.compare_exchange_weak(head, first));
+    // only touch the mutex when a worker may be asleep; it rechecks pending under the lock. The push and
+    // the sleepers load are both seq_cst, so either this sees the sleeper or the sleeper sees the push.
+    if (sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        idle.notify_one();
+    }
+}
+
+std::vector<QueryService::Request *> QueryService::takeBatch() {
+    Request *head = pending.exchange(nullptr, std::memory_order_acquire);
+    std::vector<Request *> batch;
+    for (; head != nullptr; head = head->next) {
+        batch.push_back(head);
+    }
+    // the stack hands them out newest first
+    std::reverse(batch.begin(), batch.end());
+    if (batch.size() > maxBatch) {
+        // give the newest ones back for another worker
+        for (size_t i = maxBatch; i + 1 < batch.size(); ++i) {
+            batch[i]->next = batch[i + 1];
+        }
+        pushList(batch[maxBatch], batch.back());
+        batch.resize(maxBatch);
+    }
+    return batch;
+}
+
+void QueryService::workerLoop() {
+    while (true) {
+        std::vector<Request *> batch = takeBatch();
+        if (batch.empty()) {
+            std::unique_lock<std::mutex> lock(idleMutex);
+            ++sleepers;
+            idle.wait(lock, [this]() { return pending.load() != nullptr || stopping; });
+            --sleepers;
+            if (stopping && pending.load() == nullptr) {
+                return;
+            }
+            continue;
+        }
+
+        // neighbors in Morton order hit the same nodes while they are still in cache
+        std::sort(batch.begin(), batch.end(), [](const Request *a, const Request *b) { return a->morton < b->morton; });
+        {
+            QT_TRACE_SCOPE("QueryService batch");
+            std::shared_lock<std::shared_mutex> lock(treeMutex);
+            for (Request *request: batch) {
+                execute(*request);
+            }
+        }
+        batches.fetch_add(1, std::memory_order_relaxed);
+        executed.fetch_add(batch.size(), std::memory_order_relaxed);
+        for (Request *request: batch) {
+            delete request;
+        }
+    }
+}
+
+void QueryService::execute(Request &request) {
+    Result result;
+    std::exception_ptr error;
+    try {
+        result = request.kind == Request::KNN ? tree.knn(request.point, request.k) : tree.range(request.region);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    try {
+        request.done(std::move(result), error);
+    } catch (...) {
+        // a throwing callback must not take the worker down
+    }
+}
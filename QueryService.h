@@ -0,0 +1,94 @@
+#ifndef QUERYSERVICE_H
+#define QUERYSERVICE_H
+
+#include "QuadTree.h"
+#include "Quantizer.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+// In-process query engine over one QuadTree. Callers submit knn and range requests from any thread
+// through a lock-free queue and get a future or a completion callback. Each idle worker takes everything
+// pending (up to maxBatch) as one micro-batch, sorts it in Morton order of the query location so
+// consecutive queries walk the same nodes, and runs it against the current tree.
+class QueryService {
+public:
+    using Result = std::vector<std::shared_ptr<Particle>>;
+    // Gets the result, or a null result and the exception the query threw
+    using Callback = std::function<void(Result, std::exception_ptr)>;
+
+private:
+    struct Request {
+        enum Kind { KNN, RANGE } kind;
+        Point2D point;
+        size_t k;
+        Rect region;
+        Callback done;
+        uint32_t morton;
+        Request *next;
+    };
+
+    QuadTree &tree;
+    Quantizer quantizer;
+    size_t maxBatch;
+
+    // Treiber stack of submitted requests, drained whole by the workers
+    std::atomic<Request *> pending{nullptr};
+    std::atomic<size_t> sleepers{0};
+    std::atomic<bool> stopping{false};
+    std::mutex idleMutex;
+    std::condition_variable idle;
+
+    // queries share it, update() takes it exclusively
+    std::shared_mutex treeMutex;
+    std::vector<std::thread> workers;
+
+    std::atomic<size_t> batches{0}, executed{0};
+
+    void submit(Request *request);
+
+    void pushList(Request *first, Request *last);
+
+    void workerLoop();
+
+    std::vector<Request *> takeBatch();
+
+    void execute(Request &request);
+
+public:
+    explicit QueryService(QuadTree &tree, size_t numWorkers = std::thread::hardware_concurrency(),
+                          size_t maxBatch = 256);
+
+    // Pending requests are still answered before the workers stop
+    ~QueryService();
+
+    QueryService(const QueryService &) = delete;
+
+    QueryService &operator=(const QueryService &) = delete;
+
+    // The future rethrows an exception thrown by the query
+    std::future<Result> knn(Point2D query, size_t k);
+
+    std::future<Result> range(const Rect &region);
+
+    // The callback runs on a worker thread and must not block on the service. Exceptions it throws are
+    // caught and dropped, there is no caller left to receive them.
+    void knn(Point2D query, size_t k, Callback done);
+
+    void range(const Rect &region, Callback done);
+
+    // Runs mutation (insert, updateTree, ...) with no batch in flight
+    void update(const std::function<void(QuadTree &)> &mutation);
+
+    size_t getBatchCount() const { return batches.load(); }
+
+    size_t getExecutedCount() const { return executed.load(); }
+};
+
+#endif // QUERYSERVICE_H
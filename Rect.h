@@ -2,6 +2,9 @@
 #define RECT_H
 
 #include "Point.h"
+#include <vector>
+#include <limits>
+#include <algorithm>
 
 class Rect {
 private:
@@ -13,12 +16,25 @@ public:
 
     ~Rect() = default;
 
+    // Inverted rect that any extend() call replaces; isValid() is false until then
+    static Rect empty() {
+        float inf = std::numeric_limits<float>::max();
+        return {Point2D(inf, inf), Point2D(-inf, -inf)};
+    }
+
     Point2D getPmin() const { return pmin; }
 
     Point2D getPmax() const { return pmax; }
 
     Point2D getCenter() const { return (pmin + pmax) / 2.0f; }
 
+    // Same center, each side scaled by factor (used for loose cells)
+    Rect enlarge(NType factor) const {
+        Point2D halfExtent = (pmax - pmin) * (factor * 0.5f);
+        Point2D center = getCenter();
+        return {center - halfExtent, center + halfExtent};
+    }
+
     NType distance(const Point2D &p) const {
         NType dx = NType::max(NType ::max(pmin.getX() - p.getX(), p.getX() - pmax.getX()), NType(0.0));
         NType dy = NType::max(NType ::max(pmin.getY() - p.getY(), p.getY() - pmax.getY()), NType(0.0));
@@ -36,6 +52,32 @@ public:
                pmin.getY() < other.pmax.getY() && pmax.getY() > other.pmin.getY();
     }
 
+    // Like intersects() but touching edges count as overlapping
+    bool overlaps(const Rect &other) const {
+        return pmin.getX() <= other.pmax.getX() && pmax.getX() >= other.pmin.getX() &&
+               pmin.getY() <= other.pmax.getY() && pmax.getY() >= other.pmin.getY();
+    }
+
+    // Liang-Barsky clipping of the segment [a, b] against the rect
+    bool intersectsSegment(const Point2D &a, const Point2D &b) const {
+        float t0 = 0.0f, t1 = 1.0f;
+        float d[2] = {(b - a).getX().getValue(), (b - a).getY().getValue()};
+        float lo[2] = {(pmin - a).getX().getValue(), (pmin - a).getY().getValue()};
+        float hi[2] = {(pmax - a).getX().getValue(), (pmax - a).getY().getValue()};
+        for (int axis = 0; axis < 2; ++axis) {
+            if (d[axis] == 0.0f) {
+                if (lo[axis] > 0.0f || hi[axis] < 0.0f) return false;
+                continue;
+            }
+            float tNear = lo[axis] / d[axis], tFar = hi[axis] / d[axis];
+            if (tNear > tFar) std::swap(tNear, tFar);
+            t0 = std::max(t0, tNear);
+            t1 = std::min(t1, tFar);
+            if (t0 > t1) return false;
+        }
+        return true;
+    }
+
     bool isWithin(const Rect &other) const {
         return pmin.getX() >= other.pmin.getX() && pmax.getX() <= other.pmax.getX() &&
                pmin.getY() >= other.pmin.getY() && pmax.getY() <= other.pmax.getY();
@@ -53,12 +95,38 @@ public:
         return !(*this == rect);
     }
 
+    void extend(const Point2D &p) {
+        // exact min/max: the tolerant NType ones would make the result depend on the order of the points
+        float x = p.getX().getValue(), y = p.getY().getValue();
+        pmin = Point2D(std::min(pmin.getX().getValue(), x), std::min(pmin.getY().getValue(), y));
+        pmax = Point2D(std::max(pmax.getX().getValue(), x), std::max(pmax.getY().getValue(), y));
+    }
+
+    void extend(const Rect &other) {
+        if (!other.isValid()) return;
+        extend(other.pmin);
+        extend(other.pmax);
+    }
+
+    // Bounds of the contents after moving for dt with velocities inside velocityBounds
+    Rect advance(const Rect &velocityBounds, NType dt) const {
+        return {pmin + velocityBounds.pmin * dt, pmax + velocityBounds.pmax * dt};
+    }
+
+    // Bounds of everything the contents cover while moving during [0, dt]
+    Rect sweep(const Rect &velocityBounds, NType dt) const {
+        Rect swept = advance(velocityBounds, dt);
+        swept.extend(*this);
+        return swept;
+    }
+
     std::vector<Rect> split() {
-        Point2D center = (pmax - pmin) * 0.5;
-        Rect r1 = Rect(pmin + Point2D(0, center.getY()), pmin + Point2D(0, center.getY()) + center);
-        Rect r2 = Rect(pmin + center, pmax);
-        Rect r3 = Rect(pmin, center + pmin);
-        Rect r4 = Rect(pmin + Point2D(center.getX(), 0), pmin + Point2D(center.getX(), 0) + center);
+        // children share the split point and the parent corners exactly, so they tile the parent
+        Point2D center = pmin + (pmax - pmin) * 0.5;
+        Rect r1 = Rect(Point2D(pmin.getX(), center.getY()), Point2D(center.getX(), pmax.getY()));
+        Rect r2 = Rect(center, pmax);
+        Rect r3 = Rect(pmin, center);
+        Rect r4 = Rect(Point2D(center.getX(), pmin.getY()), Point2D(pmax.getX(), center.getY()));
         return {r1, r2, r3, r4};
     }
 
@@ -0,0 +1,161 @@
+#ifndef SHAPES_H
+#define SHAPES_H
+
+#include "Rect.h"
+#include <algorithm>
+#include <array>
+#include <vector>
+
+// Query shapes for QuadTree::query and QuadTree::count. A shape provides
+//   bool overlaps(const Rect &bounds) const;  may the shape reach into bounds (false only if it surely does not)
+//   bool contains(const Rect &bounds) const;  is all of bounds inside the shape (true only if it surely is)
+//   bool contains(const Point2D &p) const;    exact point test
+// The tree is traversed through templates, so there is no virtual call per node.
+
+static inline std::array<Point2D, 4> corners(const Rect &r) {
+    return {r.getPmin(), Point2D(r.getPmax().getX(), r.getPmin().getY()), r.getPmax(),
+            Point2D(r.getPmin().getX(), r.getPmax().getY())};
+}
+
+struct RectShape {
+    Rect rect;
+
+    explicit RectShape(const Rect &rect) : rect(rect) {}
+
+    bool overlaps(const Rect &bounds) const { return rect.overlaps(bounds); }
+
+    bool contains(const Rect &bounds) const { return bounds.isWithin(rect); }
+
+    bool contains(const Point2D &p) const { return rect.contains(p); }
+};
+
+struct Circle {
+    Point2D center;
+    NType radius;
+
+    Circle(const Point2D &center, NType radius) : center(center), radius(radius) {}
+
+    bool overlaps(const Rect &bounds) const { return bounds.distance(center) <= radius; }
+
+    bool contains(const Rect &bounds) const {
+        for (const Point2D &corner: corners(bounds)) {
+            if (!contains(corner)) return false;
+        }
+        return true;
+    }
+
+    bool contains(const Point2D &p) const { return center.distance(p) <= radius; }
+};
+
+// Points p with dot(normal, p) <= offset
+struct HalfPlane {
+    Point2D normal;
+    NType offset;
+
+    HalfPlane(const Point2D &normal, NType offset) : normal(normal), offset(offset) {}
+
+    // Side of the line through a and b on the left when walking from a to b
+    static HalfPlane leftOf(const Point2D &a, const Point2D &b) {
+        Point2D direction = b - a;
+        Point2D normal(direction.getY(), -direction.getX());
+        return {normal, normal.getX() * a.getX() + normal.getY() * a.getY()};
+    }
+
+    float signedDistance(const Point2D &p) const {
+        return (normal.getX() * p.getX() + normal.getY() * p.getY() - offset).getValue();
+    }
+
+    bool overlaps(const Rect &bounds) const {
+        // the corner furthest along -normal is the one most inside
+        float x = normal.getX() > 0.0f ? bounds.getPmin().getX().getValue() : bounds.getPmax().getX().getValue();
+        float y = normal.getY() > 0.0f ? bounds.getPmin().getY().getValue() : bounds.getPmax().getY().getValue();
+        return signedDistance(Point2D(x, y)) <= 0.0f;
+    }
+
+    bool contains(const Rect &bounds) const {
+        float x = normal.getX() > 0.0f ? bounds.getPmax().getX().getValue() : bounds.getPmin().getX().getValue();
+        float y = normal.getY() > 0.0f ? bounds.getPmax().getY().getValue() : bounds.getPmin().getY().getValue();
+        return signedDistance(Point2D(x, y)) <= 0.0f;
+    }
+
+    bool contains(const Point2D &p) const { return signedDistance(p) <= 0.0f; }
+};
+
+// Convex polygon with counter-clockwise vertices, e.g. a view cone
+struct ConvexPolygon {
+    std::vector<HalfPlane> edges;
+    Rect bounds;
+
+    explicit ConvexPolygon(const std::vector<Point2D> &vertices) : bounds(Rect::empty()) {
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            edges.push_back(HalfPlane::leftOf(vertices[i], vertices[(i + 1) % vertices.size()]));
+            bounds.extend(vertices[i]);
+        }
+    }
+
+    bool overlaps(const Rect &other) const {
+        // separating axis test on the rect axes and the polygon edges
+        if (!bounds.overlaps(other)) return false;
+        for (const HalfPlane &edge: edges) {
+            if (!edge.overlaps(other)) return false;
+        }
+        return true;
+    }
+
+    bool contains(const Rect &other) const {
+        for (const HalfPlane &edge: edges) {
+            if (!edge.contains(other)) return false;
+        }
+        return !edges.empty();
+    }
+
+    bool contains(const Point2D &p) const {
+        for (const HalfPlane &edge: edges) {
+            if (!edge.contains(p)) return false;
+        }
+        return !edges.empty();
+    }
+};
+
+// Points within radius of the segment [a, b], e.g. the swept path of a moving disc
+struct Capsule {
+    Point2D a, b;
+    NType radius;
+
+    Capsule(const Point2D &a, const Point2D &b, NType radius) : a(a), b(b), radius(radius) {}
+
+    float squaredDistance(const Point2D &p) const {
+        float dx = (b - a).getX().getValue(), dy = (b - a).getY().getValue();
+        float px = (p - a).getX().getValue(), py = (p - a).getY().getValue();
+        float lengthSquared = dx * dx + dy * dy;
+        float t = lengthSquared > 0.0f ? std::clamp((px * dx + py * dy) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+        float ex = px - t * dx, ey = py - t * dy;
+        return ex * ex + ey * ey;
+    }
+
+    bool overlaps(const Rect &bounds) const {
+        if (bounds.intersectsSegment(a, b)) return true;
+        // otherwise the closest pair involves an endpoint or a corner
+        float r = radius.getValue();
+        if (bounds.distance(a) <= radius || bounds.distance(b) <= radius) return true;
+        for (const Point2D &corner: corners(bounds)) {
+            if (squaredDistance(corner) <= r * r) return true;
+        }
+        return false;
+    }
+
+    bool contains(const Rect &bounds) const {
+        // capsules are convex, so the corners decide
+        for (const Point2D &corner: corners(bounds)) {
+            if (!contains(corner)) return false;
+        }
+        return true;
+    }
+
+    bool contains(const Point2D &p) const {
+        float r = radius.getValue();
+        return squaredDistance(p) <= r * r;
+    }
+};
+
+#endif // SHAPES_H
@@ -0,0 +1,229 @@
+#include "ShardedQuadTree.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+ShardedQuadTree::ShardedQuadTree(const Rect &world, size_t rows, size_t cols, NType ghostMargin)
+        : world(world), rows(rows), cols(cols), ghostMargin(ghostMargin) {
+    if (rows == 0 || cols == 0) {
+        throw std::runtime_error("Shard grid must have at least one row and one column");
+    }
+    Point2D extent = world.getPmax() - world.getPmin();
+    NType width = extent.getX() / NType(static_cast<float>(cols));
+    NType height = extent.getY() / NType(static_cast<float>(rows));
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            Point2D pmin = world.getPmin() + Point2D(width * static_cast<float>(c), height * static_cast<float>(r));
+            Point2D pmax = pmin + Point2D(width, height);
+            // the last row and column end exactly on the world boundary
+            if (c == cols - 1) pmax.setX(world.getPmax().getX());
+            if (r == rows - 1) pmax.setY(world.getPmax().getY());
+            Shard shard;
+            shard.core = Rect(pmin, pmax);
+            shard.owned = std::make_unique<QuadTree>(shard.core);
+            shard.outbox.resize(rows * cols);
+            shards.push_back(std::move(shard));
+        }
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        workers.emplace_back(&ShardedQuadTree::workerLoop, this, i);
+    }
+    try {
+        rebuildGhosts();
+    } catch (...) {
+        stopWorkers();
+        throw;
+    }
+}
+
+ShardedQuadTree::~ShardedQuadTree() {
+    stopWorkers();
+}
+
+size_t ShardedQuadTree::shardIndex(const Point2D &p) const {
+    Point2D extent = world.getPmax() - world.getPmin();
+    float fx = ((p.getX() - world.getPmin().getX()) / extent.getX()).getValue() * static_cast<float>(cols);
+    float fy = ((p.getY() - world.getPmin().getY()) / extent.getY()).getValue() * static_cast<float>(rows);
+    auto col = static_cast<size_t>(std::clamp(std::floor(fx), 0.0f, static_cast<float>(cols - 1)));
+    auto row = static_cast<size_t>(std::clamp(std::floor(fy), 0.0f, static_cast<float>(rows - 1)));
+    // rounding can land one cell off near a border, the shard boundaries are the reference
+    const Rect &core = shards[row * cols + col].core;
+    if (p.getX() < core.getPmin().getX() && col > 0) --col;
+    else if (p.getX() > core.getPmax().getX() && col + 1 < cols) ++col;
+    if (p.getY() < core.getPmin().getY() && row > 0) --row;
+    else if (p.getY() > core.getPmax().getY() && row + 1 < rows) ++row;
+    return row * cols + col;
+}
+
+Rect ShardedQuadTree::ghostRegion(const Shard &shard) const {
+    Point2D margin(ghostMargin, ghostMargin);
+    return {shard.core.getPmin() - margin, shard.core.getPmax() + margin};
+}
+
+void ShardedQuadTree::workerLoop(size_t index) {
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(size_t)> *task;
+        {
+            std::unique_lock<std::mutex> lock(phaseMutex);
+            phaseStart.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            task = phase;
+        }
+        std::exception_ptr error;
+        try {
+            (*task)(index);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(phaseMutex);
+        if (error && !failure) {
+            failure = error;
+        }
+        if (--pending == 0) {
+            phaseDone.notify_one();
+        }
+    }
+}
+
+void ShardedQuadTree::stopWorkers() {
+    {
+        std::lock_guard<std::mutex> lock(phaseMutex);
+        stopping = true;
+    }
+    phaseStart.notify_all();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+void ShardedQuadTree::runPhase(const std::function<void(size_t)> &task) {
+    std::unique_lock<std::mutex> lock(phaseMutex);
+    phase = &task;
+    pending = workers.size();
+    ++generation;
+    phaseStart.notify_all();
+    phaseDone.wait(lock, [this]() { return pending == 0; });
+    phase = nullptr;
+    if (failure) {
+        std::exception_ptr error = failure;
+        failure = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void ShardedQuadTree::insert(const std::vector<std::shared_ptr<Particle>> &particles) {
+    QT_TRACE_SCOPE("ShardedQuadTree::insert");
+    std::vector<std::vector<std::shared_ptr<Particle>>> batches(shards.size());
+    for (const auto &particle: particles) {
+        batches[shardIndex(particle->getPosition())].push_back(particle);
+    }
+    runPhase([&](size_t i) { shards[i].owned->insert(batches[i]); });
+    rebuildGhosts();
+}
+
+void ShardedQuadTree::step() {
+    QT_TRACE_SCOPE("ShardedQuadTree::step");
+    // advance and update every shard on its own, collecting border crossings
+    runPhase([this](size_t i) {
+        QT_TRACE_SCOPE("shard advance");
+        Shard &shard = shards[i];
+        for (const auto &particle: shard.owned->getParticles()) {
+            particle->updatePosition(world);
+        }
+        std::vector<std::shared_ptr<Particle>> escaped;
+        shard.owned->updateTree(escaped);
+        for (const auto &particle: escaped) {
+            shard.outbox[shardIndex(particle->getPosition())].push_back(particle);
+        }
+    });
+
+    // batched handoff, each destination drains its slot of every outbox
+    runPhase([this](size_t destination) {
+        QT_TRACE_SCOPE("shard handoff");
+        for (Shard &source: shards) {
+            auto &batch = source.outbox[destination];
+            shards[destination].owned->insert(batch);
+            batch.clear();
+        }
+    });
+
+    rebuildGhosts();
+}
+
+void ShardedQuadTree::rebuildGhosts() {
+    runPhase([this](size_t i) {
+        QT_TRACE_SCOPE("shard ghosts");
+        Shard &shard = shards[i];
+        Rect region = ghostRegion(shard);
+        shard.ghosts = std::make_unique<QuadTree>(region);
+        for (size_t n = 0; n < shards.size(); ++n) {
+            if (n != i && shards[n].core.overlaps(region)) {
+                shard.ghosts->insert(shards[n].owned->range(region));
+            }
+        }
+    });
+}
+
+bool ShardedQuadTree::coversLocally(const Shard &shard, const Point2D &center, NType r) const {
+    // beyond the world border there is nothing to miss
+    Rect region = ghostRegion(shard);
+    return (center.getX() - r >= region.getPmin().getX() || region.getPmin().getX() <= world.getPmin().getX()) &&
+           (center.getX() + r <= region.getPmax().getX() || region.getPmax().getX() >= world.getPmax().getX()) &&
+           (center.getY() - r >= region.getPmin().getY() || region.getPmin().getY() <= world.getPmin().getY()) &&
+           (center.getY() + r <= region.getPmax().getY() || region.getPmax().getY() >= world.getPmax().getY());
+}
+
+std::vector<std::shared_ptr<Particle>> ShardedQuadTree::knn(Point2D query, size_t k) const {
+    auto nearestFirst = [&query](const std::shared_ptr<Particle> &a, const std::shared_ptr<Particle> &b) {
+        return query.distance(a->getPosition()).getValue() < query.distance(b->getPosition()).getValue();
+    };
+    auto merge = [&](std::vector<std::shared_ptr<Particle>> candidates) {
+        std::sort(candidates.begin(), candidates.end(), nearestFirst);
+        if (candidates.size() > k) {
+            candidates.resize(k);
+        }
+        return candidates;
+    };
+
+    const Shard &shard = shards[shardIndex(query)];
+    std::vector<std::shared_ptr<Particle>> local = shard.owned->knn(query, k);
+    std::vector<std::shared_ptr<Particle>> ghosts = shard.ghosts->knn(query, k);
+    local.insert(local.end(), ghosts.begin(), ghosts.end());
+    local = merge(local);
+    if (local.size() == k && (k == 0 || coversLocally(shard, query, query.distance(local.back()->getPosition())))) {
+        return local;
+    }
+
+    // the k-th neighbor may lie past the ghost margin, ask every shard
+    std::vector<std::shared_ptr<Particle>> candidates;
+    for (const Shard &other: shards) {
+        std::vector<std::shared_ptr<Particle>> nearest = other.owned->knn(query, k);
+        candidates.insert(candidates.end(), nearest.begin(), nearest.end());
+    }
+    return merge(candidates);
+}
+
+std::vector<std::shared_ptr<Particle>> ShardedQuadTree::radius(Point2D center, NType r) const {
+    const Shard &shard = shards[shardIndex(center)];
+    if (coversLocally(shard, center, r)) {
+        std::vector<std::shared_ptr<Particle>> result = shard.owned->radius(center, r);
+        std::vector<std::shared_ptr<Particle>> ghosts = shard.ghosts->radius(center, r);
+        result.insert(result.end(), ghosts.begin(), ghosts.end());
+        return result;
+    }
+
+    std::vector<std::shared_ptr<Particle>> result;
+    for (const Shard &other: shards) {
+        if (other.core.distance(center) <= r) {
+            std::vector<std::shared_ptr<Particle>> inShard = other.owned->radius(center, r);
+            result.insert(result.end(), inShard.begin(), inShard.end());
+        }
+    }
+    return result;
+}
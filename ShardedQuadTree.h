@@ -0,0 +1,87 @@
+#ifndef SHARDEDQUADTREE_H
+#define SHARDEDQUADTREE_H
+
+#include "QuadTree.h"
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// World split into a rows x cols grid of independent QuadTrees, each advanced and updated by its own
+// worker thread. The workers live as long as the tree and wait between phases. Every shard also
+// indexes a ghost copy of the neighbor particles within ghostMargin of its cell, so local knn/radius
+// queries are answered by one shard. Particles that cross a shard border are handed off in one batch
+// per step.
+class ShardedQuadTree {
+private:
+    struct Shard {
+        Rect core;
+        std::unique_ptr<QuadTree> owned;
+        std::unique_ptr<QuadTree> ghosts;
+        // particles that left this shard during the last step, by destination shard
+        std::vector<std::vector<std::shared_ptr<Particle>>> outbox;
+    };
+
+    Rect world;
+    size_t rows, cols;
+    NType ghostMargin;
+    std::vector<Shard> shards;
+
+    // one persistent worker per shard; runPhase publishes a task under a new generation and waits
+    // until every worker has finished it
+    std::vector<std::thread> workers;
+    std::mutex phaseMutex;
+    std::condition_variable phaseStart, phaseDone;
+    const std::function<void(size_t)> *phase = nullptr;
+    uint64_t generation = 0;
+    size_t pending = 0;
+    bool stopping = false;
+    std::exception_ptr failure;
+
+    size_t shardIndex(const Point2D &p) const;
+
+    // core enlarged by ghostMargin on every side
+    Rect ghostRegion(const Shard &shard) const;
+
+    void rebuildGhosts();
+
+    void workerLoop(size_t index);
+
+    void stopWorkers();
+
+    // Runs task(i) for every shard i on the shard workers, rethrows the first exception
+    void runPhase(const std::function<void(size_t)> &task);
+
+    // true when every particle within distance r of center is visible to the shard
+    bool coversLocally(const Shard &shard, const Point2D &center, NType r) const;
+
+public:
+    ShardedQuadTree(const Rect &world, size_t rows, size_t cols, NType ghostMargin);
+
+    ~ShardedQuadTree();
+
+    ShardedQuadTree(const ShardedQuadTree &) = delete;
+
+    ShardedQuadTree &operator=(const ShardedQuadTree &) = delete;
+
+    void insert(const std::vector<std::shared_ptr<Particle>> &particles);
+
+    // Moves every particle one time step inside the world, updates the shards, hands off border
+    // crossings and refreshes the ghosts
+    void step();
+
+    std::vector<std::shared_ptr<Particle>> knn(Point2D query, size_t k) const;
+
+    std::vector<std::shared_ptr<Particle>> radius(Point2D center, NType r) const;
+
+    size_t getShardCount() const { return shards.size(); }
+
+    const QuadTree &getShard(size_t index) const { return *shards[index].owned; }
+
+    const Rect &getShardBoundary(size_t index) const { return shards[index].core; }
+};
+
+#endif // SHARDEDQUADTREE_H
@@ -0,0 +1,221 @@
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start, duration;
+    uint64_t cycles, instructions;
+};
+
+// One lane of the timeline. A thread owns it while it runs, finished threads hand it to the next one.
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    // only the owning thread writes; release stores let dump() read completed events
+    std::atomic<uint64_t> written{0};
+    int counterFds[2] = {-1, -1}; // perf group: cycles leads, instructions follows
+    // guarded by registryMutex: whether a running thread owns the lane, and (first event, tid) of every
+    // owner whose events may still be in the ring, so each thread gets its own tid
+    bool inUse = false;
+    std::vector<std::pair<uint64_t, uint64_t>> owners;
+
+    TraceBuffer() : events(Trace::capacity) {}
+};
+
+static std::mutex registryMutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static std::vector<TraceBuffer *> idleBuffers;
+static uint64_t nextTid = 1;
+static std::atomic<bool> countersEnabled{false};
+static thread_local TraceBuffer *ownBuffer = nullptr;
+
+static uint64_t now() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static const uint64_t traceEpoch = now();
+
+#ifdef __linux__
+static int openCounter(uint64_t config, int groupFd) {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = groupFd == -1 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    // this thread, any CPU
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+}
+
+static void openCounters(int *fds) {
+    fds[0] = openCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (fds[0] < 0) {
+        return;
+    }
+    fds[1] = openCounter(PERF_COUNT_HW_INSTRUCTIONS, fds[0]);
+    if (fds[1] < 0) {
+        close(fds[0]);
+        fds[0] = -1;
+        return;
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static void closeCounters(int *fds) {
+    for (int i = 1; i >= 0; --i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+static void readCounters(int fd, uint64_t *out) {
+    struct {
+        uint64_t count;
+        uint64_t values[2];
+    } group{};
+    if (read(fd, &group, sizeof(group)) == static_cast<ssize_t>(sizeof(group))) {
+        out[0] = group.values[0];
+        out[1] = group.values[1];
+    }
+}
+#endif
+
+// Binds a buffer to the current thread for as long as it runs
+class TraceLane {
+public:
+    TraceBuffer *buffer;
+
+    TraceLane() {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        if (idleBuffers.empty()) {
+            buffers.push_back(std::make_unique<TraceBuffer>());
+            buffer = buffers.back().get();
+        } else {
+            buffer = idleBuffers.back();
+            idleBuffers.pop_back();
+        }
+        buffer->inUse = true;
+        uint64_t written = buffer->written.load(std::memory_order_relaxed);
+        buffer->owners.emplace_back(written, nextTid++);
+        // forget owners whose events have all been overwritten
+        size_t overwritten = 0;
+        while (overwritten + 1 < buffer->owners.size() &&
+               buffer->owners[overwritten + 1].first + Trace::capacity <= written) {
+            ++overwritten;
+        }
+        buffer->owners.erase(buffer->owners.begin(), buffer->owners.begin() + static_cast<std::ptrdiff_t>(overwritten));
+        ownBuffer = buffer;
+#ifdef __linux__
+        // counters follow the thread that opened them, so every new owner opens its own
+        if (countersEnabled) {
+            openCounters(buffer->counterFds);
+        }
+#endif
+    }
+
+    ~TraceLane() {
+#ifdef __linux__
+        closeCounters(buffer->counterFds);
+#endif
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffer->inUse = false;
+        idleBuffers.push_back(buffer);
+    }
+};
+
+static TraceBuffer *threadBuffer() {
+    thread_local TraceLane lane;
+    return lane.buffer;
+}
+
+TraceScope::TraceScope(const char *name) : buffer(threadBuffer()), name(name), counters{0, 0} {
+#ifdef __linux__
+    if (buffer->counterFds[0] >= 0) {
+        readCounters(buffer->counterFds[0], counters);
+    }
+#endif
+    start = now();
+}
+
+TraceScope::~TraceScope() {
+    uint64_t end = now();
+    TraceEvent event{name, start, end - start, 0, 0};
+#ifdef __linux__
+    if (buffer->counterFds[0] >= 0) {
+        uint64_t after[2] = {counters[0], counters[1]};
+        readCounters(buffer->counterFds[0], after);
+        event.cycles = after[0] - counters[0];
+        event.instructions = after[1] - counters[1];
+    }
+#endif
+    uint64_t written = buffer->written.load(std::memory_order_relaxed);
+    buffer->events[written % Trace::capacity] = event;
+    buffer->written.store(written + 1, std::memory_order_release);
+}
+
+void Trace::enableCounters() {
+    countersEnabled = true;
+}
+
+void Trace::dump(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        throw std::runtime_error("Cannot write trace to " + path);
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer: buffers) {
+        // another running thread may be writing this lane right now
+        if (buffer->inUse && buffer.get() != ownBuffer) {
+            continue;
+        }
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t kept = written < capacity ? written : capacity;
+        const auto &owners = buffer->owners;
+        for (size_t o = 0; o < owners.size(); ++o) {
+            uint64_t end = o + 1 < owners.size() ? owners[o + 1].first : written;
+            if (end > written - kept && end > owners[o].first) {
+                out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                    << owners[o].second << ",\"args\":{\"name\":\"thread " << owners[o].second << "\"}}";
+                first = false;
+            }
+        }
+        size_t owner = 0;
+        for (uint64_t i = written - kept; i < written; ++i) {
+            while (owner + 1 < owners.size() && owners[owner + 1].first <= i) {
+                ++owner;
+            }
+            const TraceEvent &event = buffer->events[i % capacity];
+            // Chrome trace timestamps are microseconds
+            out << (first ? "" : ",") << "\n{\"name\":\"" << event.name
+                << "\",\"cat\":\"quadtree\",\"ph\":\"X\",\"pid\":1,\"tid\":" << owners[owner].second
+                << ",\"ts\":" << static_cast<double>(event.start - traceEpoch) / 1000.0
+                << ",\"dur\":" << static_cast<double>(event.duration) / 1000.0;
+            first = false;
+            if (event.cycles != 0 || event.instructions != 0) {
+                out << ",\"args\":{\"cycles\":" << event.cycles << ",\"instructions\":" << event.instructions << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+}
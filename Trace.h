@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Scoped timeline tracing of the hot paths, compiled in with the QUADTREE_TRACING build option and
+// reduced to nothing otherwise. Each thread records complete events (name, start and duration in
+// steady_clock nanoseconds) into its own fixed ring buffer without taking locks, and dump() writes the
+// most recent ones as Chrome trace JSON for chrome://tracing or Perfetto. With counters enabled every
+// event also carries the CPU cycles and instructions of its scope, read through perf_event_open when
+// the kernel allows it.
+
+struct TraceBuffer;
+
+class Trace {
+public:
+    // Events kept per thread (2.5 MB); older ones are overwritten
+    static constexpr size_t capacity = 1 << 16;
+
+    // Counts cycles and instructions per scope in threads that start tracing from now on
+    static void enableCounters();
+
+    // Writes the events of the calling thread and of every finished thread, one tid per thread even when
+    // threads took turns on a lane. Lanes of threads still running elsewhere are skipped.
+    static void dump(const std::string &path);
+};
+
+// Records one event covering its lifetime, name must outlive the trace (a string literal)
+class TraceScope {
+private:
+    TraceBuffer *buffer;
+    const char *name;
+    uint64_t start;
+    uint64_t counters[2];
+
+public:
+    explicit TraceScope(const char *name);
+
+    ~TraceScope();
+
+    TraceScope(const TraceScope &) = delete;
+
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+#ifdef QUADTREE_TRACING
+#define QT_TRACE_CONCAT_(a, b) a##b
+#define QT_TRACE_CONCAT(a, b) QT_TRACE_CONCAT_(a, b)
+#define QT_TRACE_SCOPE(name) TraceScope QT_TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define QT_TRACE_SCOPE(name) ((void) 0)
+#endif
+
+#endif // TRACE_H
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "QuadTree.h"
+#include "QueryServer.h"
+#include "QueryService.h"
+
+// Load generator for QueryService: concurrent clients issue kNN and range requests, either through the
+// UNIX socket front end or directly in process, and the latency distribution is reported.
+//
+// usage: loadgen [particles] [clients] [requestsPerClient] [k] [socket|inprocess]
+
+int main(int argc, char *argv[]) {
+    size_t numParticles = argc > 1 ? std::stoul(argv[1]) : 200000;
+    size_t numClients = argc > 2 ? std::stoul(argv[2]) : 16;
+    size_t requestsPerClient = argc > 3 ? std::stoul(argv[3]) : 2000;
+    size_t k = argc > 4 ? std::stoul(argv[4]) : 8;
+    bool overSocket = argc <= 5 || std::string(argv[5]) != "inprocess";
+
+    Rect boundary(Point2D(0, 0), Point2D(100, 100));
+    QuadTree tree(boundary);
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> posDist(0.0f, 100.0f);
+    std::uniform_real_distribution<float> velDist(-5.0f, 5.0f);
+    std::vector<std::shared_ptr<Particle>> particles;
+    for (size_t i = 0; i < numParticles; ++i) {
+        particles.push_back(std::make_shared<Particle>(Point2D(posDist(gen), posDist(gen)),
+                                                       Point2D(velDist(gen), velDist(gen))));
+    }
+    tree.insert(particles);
+
+    QueryService service(tree);
+    std::string socketPath = "/tmp/quadtree-loadgen-" + std::to_string(getpid()) + ".sock";
+    std::unique_ptr<QueryServer> server;
+    if (overSocket) {
+        server = std::make_unique<QueryServer>(service, socketPath);
+    }
+
+    std::vector<std::vector<double>> latencies(numClients);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < numClients; ++c) {
+        clients.emplace_back([&, c]() {
+            std::mt19937 clientGen(static_cast<unsigned>(c));
+            std::uniform_real_distribution<float> pos(0.0f, 100.0f);
+            std::unique_ptr<QueryClient> client;
+            if (overSocket) {
+                client = std::make_unique<QueryClient>(socketPath);
+            }
+            for (size_t i = 0; i < requestsPerClient; ++i) {
+                float x = pos(clientGen), y = pos(clientGen);
+                // one range request for every nine kNN requests
+                bool isRange = i % 10 == 9;
+                auto sent = std::chrono::steady_clock::now();
+                if (overSocket) {
+                    std::string line = isRange ? "range " + std::to_string(x) + " " + std::to_string(y) + " " +
+                                                 std::to_string(x + 1.0f) + " " + std::to_string(y + 1.0f)
+                                               : "knn " + std::to_string(x) + " " + std::to_string(y) + " " +
+                                                 std::to_string(k);
+                    client->request(line);
+                } else if (isRange) {
+                    service.range(Rect(Point2D(x, y), Point2D(x + 1.0f, y + 1.0f))).get();
+                } else {
+                    service.knn(Point2D(x, y), k).get();
+                }
+                auto received = std::chrono::steady_clock::now();
+                latencies[c].push_back(std::chrono::duration<double, std::micro>(received - sent).count());
+            }
+        });
+    }
+    for (auto &client: clients) {
+        client.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> all;
+    for (const auto &clientLatencies: latencies) {
+        all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) { return all[std::min(all.size() - 1, static_cast<size_t>(p * all.size()))]; };
+
+    std::cout << (overSocket ? "socket" : "in-process") << ": " << all.size() << " requests from " << numClients
+              << " clients in " << seconds << " s (" << all.size() / seconds << " req/s)" << std::endl;
+    std::cout << "latency us  p50 " << percentile(0.50) << "  p90 " << percentile(0.90) << "  p99 "
+              << percentile(0.99) << "  max " << all.back() << std::endl;
+    std::cout << "batches " << service.getBatchCount() << ", mean batch size "
+              << static_cast<double>(service.getExecutedCount()) / std::max<size_t>(service.getBatchCount(), 1)
+              << std::endl;
+    return 0;
+}
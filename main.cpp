@@ -1,8 +1,22 @@
 #include <iostream>
+#include <sstream>
+#include <iomanip>
 #include <set>
 #include <random>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <cstdlib>
+#include <unistd.h>
 #include "QuadTree.h"
+#include "Morton.h"
+#include "PagedQuadTree.h"
+#include "CompactQuadTree.h"
+#include "ShardedQuadTree.h"
+#include "QueryService.h"
+#include "QueryServer.h"
+#include "Trace.h"
 
 std::vector<std::shared_ptr<Particle>> generateRandomParticles(int n, const Rect& boundary, NType maxVelocityMagnitude) {
     std::vector<std::shared_ptr<Particle>> particles;
@@ -177,7 +191,7 @@ bool verifyNoIntersectingChildBoundaries(QuadNode* rootNode) {
 bool traverseAndCheckParticlesInCorrectLeaf(QuadNode* node) {
     if (node->isLeaf()) {
         for (const auto& particle : node->getParticles()) {
-            if (!node->getBoundary().contains(particle->getPosition())) {
+            if (!node->getLooseBoundary().contains(particle->getPosition())) {
                 std::cout << "Particle " << particle->getPosition() << " is out of its leaf boundary." << std::endl;
                 return false;
             }
@@ -237,6 +251,634 @@ bool verifyKnnSearch(QuadTree& tree, const std::vector<std::shared_ptr<Particle>
     return true;
 }
 
+Rect randomRegion(std::mt19937& gen, const Rect& boundary) {
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    float x1 = posDistX(gen), x2 = posDistX(gen);
+    float y1 = posDistY(gen), y2 = posDistY(gen);
+    return Rect(Point2D(std::min(x1, x2), std::min(y1, y2)), Point2D(std::max(x1, x2), std::max(y1, y2)));
+}
+
+bool sameParticles(std::vector<std::shared_ptr<Particle>> a, std::vector<std::shared_ptr<Particle>> b) {
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    return a == b;
+}
+
+// Test 9: Verify range search
+bool verifyRangeSearch(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    Rect region = randomRegion(gen, boundary);
+
+    std::vector<std::shared_ptr<Particle>> rangeBruteForce;
+    for (const auto& particle : particles) {
+        if (region.contains(particle->getPosition())) {
+            rangeBruteForce.push_back(particle);
+        }
+    }
+    return sameParticles(tree.range(region), rangeBruteForce);
+}
+
+// Test 10: Verify predictive range search
+bool verifyPredictiveRangeSearch(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    Rect region = randomRegion(gen, boundary);
+    NType horizon = std::uniform_real_distribution<float>(0.0f, 3.0f)(gen);
+
+    std::vector<std::shared_ptr<Particle>> rangeBruteForce;
+    for (const auto& particle : particles) {
+        Point2D predicted = particle->getPosition() + particle->getVelocity() * horizon;
+        if (region.intersectsSegment(particle->getPosition(), predicted)) {
+            rangeBruteForce.push_back(particle);
+        }
+    }
+    try {
+        tree.range(region, -horizon - 1.0f);
+        return false;
+    } catch (const std::runtime_error&) {
+        // a negative horizon is rejected instead of matching nothing
+    }
+    return sameParticles(tree.range(region, horizon), rangeBruteForce);
+}
+
+// Test 11: Verify predictive k-NN search
+bool verifyPredictiveKnnSearch(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    Point2D queryPoint(posDistX(gen), posDistY(gen));
+    NType horizon = std::uniform_real_distribution<float>(0.0f, 3.0f)(gen);
+    size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+
+    std::vector<std::shared_ptr<Particle>> knnTree = tree.knn(queryPoint, k, horizon);
+
+    auto predictedDistance = [&](const std::shared_ptr<Particle>& p) {
+        return queryPoint.distance(p->getPosition() + p->getVelocity() * horizon);
+    };
+    std::vector<std::shared_ptr<Particle>> knnBruteForce = particles;
+    std::partial_sort(knnBruteForce.begin(), knnBruteForce.begin() + k, knnBruteForce.end(), [&](const std::shared_ptr<Particle>& a, const std::shared_ptr<Particle>& b) {
+        return predictedDistance(a) < predictedDistance(b);
+    });
+    knnBruteForce.resize(k);
+
+    if (knnTree.size() != knnBruteForce.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < k; ++i) {
+        if (predictedDistance(knnTree[i]) != predictedDistance(knnBruteForce[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test 12: Verify all-kNN against independent k-NN queries
+bool verifyAllKnn(QuadTree& tree) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+
+    std::vector<std::shared_ptr<Particle>> ordered = tree.getParticles();
+    std::vector<size_t> neighbors = tree.allKnn(k);
+    if (neighbors.size() != ordered.size() * k) {
+        return false;
+    }
+    std::uniform_int_distribution<size_t> indexDist(0, ordered.size() - 1);
+    for (int sample = 0; sample < 100; ++sample) {
+        size_t i = indexDist(gen);
+        Point2D queryPoint = ordered[i]->getPosition();
+        std::vector<std::shared_ptr<Particle>> knnTree = tree.knn(queryPoint, k);
+        for (size_t j = 0; j < k; ++j) {
+            if (queryPoint.distance(ordered[neighbors[i * k + j]]->getPosition()) != queryPoint.distance(knnTree[j]->getPosition())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Test 13: Verify warm-started k-NN along a moving query point
+bool verifyTrackedKnn(QuadTree& tree, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    std::uniform_real_distribution<float> stepDist(-0.5f, 0.5f);
+    size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+
+    KNNTracker tracker(tree, k);
+    Point2D queryPoint(posDistX(gen), posDistY(gen));
+    for (int frame = 0; frame < 50; ++frame) {
+        std::vector<std::shared_ptr<Particle>> knnTracked = tracker.query(queryPoint);
+        std::vector<std::shared_ptr<Particle>> knnTree = tree.knn(queryPoint, k);
+        if (knnTracked.size() != knnTree.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < knnTree.size(); ++i) {
+            if (queryPoint.distance(knnTracked[i]->getPosition()) != queryPoint.distance(knnTree[i]->getPosition())) {
+                return false;
+            }
+        }
+        Point2D moved = queryPoint + Point2D(stepDist(gen), stepDist(gen));
+        if (boundary.contains(moved)) {
+            queryPoint = moved;
+        }
+    }
+    return true;
+}
+
+// Test 14: Verify the disk-backed tree against brute force
+bool verifyPagedQuadTree(const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::vector<Particle> copies;
+    for (const auto& particle : particles) {
+        copies.push_back(*particle);
+    }
+    std::string path = (std::filesystem::temp_directory_path() / "quadtree_pages_XXXXXX").string();
+    int unique = mkstemp(path.data());
+    if (unique < 0) {
+        return false;
+    }
+    close(unique);
+
+    bool rejected = false;
+    try {
+        PagedQuadTree outside(path, boundary, {Particle(boundary.getPmax() + Point2D(1, 1), Point2D())});
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+
+    // input in chunks and a small memory budget, so the upper levels are partitioned on disk
+    size_t next = 0;
+    auto source = [&](std::vector<Particle>& chunk) {
+        for (; next < copies.size() && chunk.size() < 10000; ++next) {
+            chunk.push_back(copies[next]);
+        }
+        return !chunk.empty();
+    };
+    PagedQuadTree pagedTree(path, boundary, source, 4096, 64, 8192);
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    Point2D queryPoint(posDistX(gen), posDistY(gen));
+    size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+
+    std::vector<Particle> knnPaged = pagedTree.knn(queryPoint, k);
+    std::vector<float> knnBruteForce;
+    for (const auto& particle : copies) {
+        knnBruteForce.push_back(queryPoint.distance(particle.getPosition()).getValue());
+    }
+    std::partial_sort(knnBruteForce.begin(), knnBruteForce.begin() + k, knnBruteForce.end());
+    bool passed = rejected && pagedTree.size() == copies.size() && knnPaged.size() == k;
+    for (size_t i = 0; passed && i < k; ++i) {
+        passed = queryPoint.distance(knnPaged[i].getPosition()) == knnBruteForce[i];
+    }
+
+    Rect region = randomRegion(gen, boundary);
+    size_t inRegion = std::count_if(copies.begin(), copies.end(), [&region](const Particle& p) {
+        return region.contains(p.getPosition());
+    });
+    passed = passed && pagedTree.range(region).size() == inRegion && pagedTree.getPageMisses() > 0;
+
+    std::filesystem::remove(path);
+    return passed;
+}
+
+bool verifySubtreeCounts(QuadNode* rootNode, size_t numParticles);
+
+// Test 15: Verify shard ownership and sharded queries after a few steps
+bool verifyShardedQuadTree(const Rect& boundary) {
+    std::vector<std::shared_ptr<Particle>> particles = generateRandomParticles(50000, boundary, 5.0);
+    ShardedQuadTree sharded(boundary, 3, 3, 5.0);
+    sharded.insert(particles);
+    for (int step = 0; step < 3; ++step) {
+        sharded.step();
+    }
+
+    // every particle owned by exactly one shard, inside its boundary
+    std::set<std::shared_ptr<Particle>> owned;
+    size_t ownedCount = 0;
+    for (size_t i = 0; i < sharded.getShardCount(); ++i) {
+        const QuadTree& shard = sharded.getShard(i);
+        if (!verifySubtreeCounts(shard.getRoot().get(), shard.getParticles().size())) {
+            return false;
+        }
+        for (const auto& particle : shard.getParticles()) {
+            if (!sharded.getShardBoundary(i).contains(particle->getPosition())) {
+                return false;
+            }
+            owned.insert(particle);
+            ++ownedCount;
+        }
+    }
+    if (ownedCount != particles.size() || owned != std::set<std::shared_ptr<Particle>>(particles.begin(), particles.end())) {
+        return false;
+    }
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    for (int sample = 0; sample < 20; ++sample) {
+        Point2D queryPoint(posDistX(gen), posDistY(gen));
+        size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+        NType r = std::uniform_real_distribution<float>(0.5f, 8.0f)(gen);
+
+        std::vector<float> knnBruteForce;
+        std::vector<std::shared_ptr<Particle>> radiusBruteForce;
+        for (const auto& particle : particles) {
+            knnBruteForce.push_back(queryPoint.distance(particle->getPosition()).getValue());
+            if (queryPoint.distance(particle->getPosition()) <= r) {
+                radiusBruteForce.push_back(particle);
+            }
+        }
+        std::partial_sort(knnBruteForce.begin(), knnBruteForce.begin() + k, knnBruteForce.end());
+        std::vector<std::shared_ptr<Particle>> knnSharded = sharded.knn(queryPoint, k);
+        if (knnSharded.size() != k) {
+            return false;
+        }
+        for (size_t i = 0; i < k; ++i) {
+            if (queryPoint.distance(knnSharded[i]->getPosition()) != knnBruteForce[i]) {
+                return false;
+            }
+        }
+        if (!sameParticles(sharded.radius(queryPoint, r), radiusBruteForce)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test 16: Verify concurrent queries through the query service
+bool verifyQueryService(QuadTree& tree, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+
+    QueryService service(tree, 4);
+    std::vector<Point2D> queryPoints;
+    std::vector<std::future<QueryService::Result>> knnResults;
+    for (int i = 0; i < 200; ++i) {
+        queryPoints.emplace_back(posDistX(gen), posDistY(gen));
+        knnResults.push_back(service.knn(queryPoints.back(), k));
+    }
+    Rect region = randomRegion(gen, boundary);
+    std::future<QueryService::Result> rangeResult = service.range(region);
+
+    for (size_t i = 0; i < queryPoints.size(); ++i) {
+        std::vector<std::shared_ptr<Particle>> knnService = knnResults[i].get();
+        std::vector<std::shared_ptr<Particle>> knnTree = tree.knn(queryPoints[i], k);
+        if (knnService != knnTree) {
+            return false;
+        }
+    }
+    if (!sameParticles(rangeResult.get(), tree.range(region))) {
+        return false;
+    }
+
+    // un callback que lanza no debe tumbar al worker
+    service.knn(queryPoints[0], k, [](QueryService::Result, std::exception_ptr) { throw std::runtime_error("callback"); });
+    if (service.knn(queryPoints[0], k).get() != tree.knn(queryPoints[0], k)) {
+        return false;
+    }
+
+    // ida y vuelta por el socket, con una conexion nueva por consulta para que el servidor recoja las cerradas
+    std::string socketPath = (std::filesystem::temp_directory_path() /
+                              ("quadtree_" + std::to_string(getpid()) + ".sock")).string();
+    QueryServer server(service, socketPath);
+    for (size_t i = 0; i < 20; ++i) {
+        const Point2D& query = queryPoints[i];
+        std::ostringstream request;
+        request << std::setprecision(9) << "knn " << query.getX().getValue() << ' ' << query.getY().getValue() << ' ' << k;
+        std::istringstream reply(QueryClient(socketPath).request(request.str()));
+        std::vector<std::shared_ptr<Particle>> expected = tree.knn(query, k);
+        size_t n;
+        if (!(reply >> n) || n != expected.size()) {
+            return false;
+        }
+        for (const auto& particle : expected) {
+            float x, y;
+            if (!(reply >> x >> y) || x != particle->getPosition().getX().getValue() ||
+                y != particle->getPosition().getY().getValue()) {
+                return false;
+            }
+        }
+    }
+    QueryClient client(socketPath);
+    return client.request("bogus").rfind("error", 0) == 0;
+}
+
+// Test 17: Verify subtree counts match the particles below every node
+size_t traverseAndCheckCounts(QuadNode* node, bool& consistent) {
+    size_t found = node->getParticles().size();
+    for (const auto& child : node->getChildren()) {
+        if (child) {
+            found += traverseAndCheckCounts(child.get(), consistent);
+        }
+    }
+    if (found != node->getCount()) {
+        consistent = false;
+    }
+    return found;
+}
+
+bool verifySubtreeCounts(QuadNode* rootNode, size_t numParticles) {
+    bool consistent = true;
+    return traverseAndCheckCounts(rootNode, consistent) == numParticles && consistent;
+}
+
+// Test 18: Verify count and density grid queries
+bool verifyCountQueries(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    Rect region = randomRegion(gen, boundary);
+    size_t inRegion = std::count_if(particles.begin(), particles.end(), [&region](const std::shared_ptr<Particle>& p) {
+        return region.contains(p->getPosition());
+    });
+    if (tree.countInRect(region) != inRegion) {
+        return false;
+    }
+
+    size_t rows = std::uniform_int_distribution<size_t>(1, 64)(gen);
+    size_t cols = std::uniform_int_distribution<size_t>(1, 64)(gen);
+    std::vector<size_t> grid = tree.densityGrid(rows, cols);
+    std::vector<size_t> gridBruteForce(rows * cols, 0);
+    float cellWidth = (boundary.getPmax().getX() - boundary.getPmin().getX()).getValue() / cols;
+    float cellHeight = (boundary.getPmax().getY() - boundary.getPmin().getY()).getValue() / rows;
+    for (const auto& particle : particles) {
+        float x = (particle->getPosition().getX() - boundary.getPmin().getX()).getValue();
+        float y = (particle->getPosition().getY() - boundary.getPmin().getY()).getValue();
+        size_t col = std::min(cols - 1, static_cast<size_t>(std::max(0.0f, std::floor(x / cellWidth))));
+        size_t row = std::min(rows - 1, static_cast<size_t>(std::max(0.0f, std::floor(y / cellHeight))));
+        gridBruteForce[row * cols + col] += 1;
+    }
+    return grid == gridBruteForce;
+}
+
+// Test 19: Verify generic shape queries against brute force
+template<typename Shape>
+bool verifyShapeQuery(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Shape& shape) {
+    std::vector<std::shared_ptr<Particle>> bruteForce;
+    for (const auto& particle : particles) {
+        if (shape.contains(particle->getPosition())) {
+            bruteForce.push_back(particle);
+        }
+    }
+    return sameParticles(tree.query(shape), bruteForce) && tree.count(shape) == bruteForce.size();
+}
+
+bool verifyShapeQueries(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    std::uniform_real_distribution<float> sizeDist(0.5f, 20.0f);
+    std::uniform_real_distribution<float> angleDist(0.0f, 6.2831853f);
+
+    Point2D a(posDistX(gen), posDistY(gen));
+    Point2D b(posDistX(gen), posDistY(gen));
+    if (!verifyShapeQuery(tree, particles, Circle(a, sizeDist(gen))) ||
+        !verifyShapeQuery(tree, particles, Capsule(a, b, sizeDist(gen) / 4)) ||
+        !verifyShapeQuery(tree, particles, RectShape(randomRegion(gen, boundary)))) {
+        return false;
+    }
+
+    // view cone: apex at a, opening towards a random direction
+    float heading = angleDist(gen), spread = 0.4f, reach = 2 * sizeDist(gen);
+    ConvexPolygon cone({a,
+                        a + Point2D(std::cos(heading - spread), std::sin(heading - spread)) * reach,
+                        a + Point2D(std::cos(heading + spread), std::sin(heading + spread)) * reach});
+    if (!verifyShapeQuery(tree, particles, cone)) {
+        return false;
+    }
+
+    // un poligono alineado con los ejes debe dar lo mismo que el rectangulo
+    Rect region = randomRegion(gen, boundary);
+    std::array<Point2D, 4> regionCorners = corners(region);
+    ConvexPolygon square({regionCorners.begin(), regionCorners.end()});
+    if (!sameParticles(tree.query(square), tree.query(RectShape(region))) ||
+        tree.count(square) != tree.count(RectShape(region))) {
+        return false;
+    }
+
+    // triangulo contado a mano: 3 de los 6 puntos caen dentro
+    QuadTree small(Rect(Point2D(-10, -10), Point2D(10, 10)));
+    small.insert({std::make_shared<Particle>(Point2D(1, 1), Point2D()),
+                  std::make_shared<Particle>(Point2D(3, 3), Point2D()),
+                  std::make_shared<Particle>(Point2D(0.5f, 3), Point2D()),
+                  std::make_shared<Particle>(Point2D(5, 1), Point2D()),
+                  std::make_shared<Particle>(Point2D(-1, 1), Point2D()),
+                  std::make_shared<Particle>(Point2D(1, 0.5f), Point2D())});
+    ConvexPolygon triangle({Point2D(0, 0), Point2D(4, 0), Point2D(0, 4)});
+    if (small.count(triangle) != 3 || small.query(triangle).size() != 3) {
+        return false;
+    }
+    HalfPlane half(Point2D(std::cos(heading), std::sin(heading)), a.getX() * std::cos(heading) + a.getY() * std::sin(heading));
+    return verifyShapeQuery(tree, particles, half);
+}
+
+// Test 20: Verify content bounds are the tight bounds of the particles below every node
+Rect traverseAndCheckContentBounds(QuadNode* node, bool& consistent) {
+    Rect found = Rect::empty();
+    for (const auto& particle : node->getParticles()) {
+        found.extend(particle->getPosition());
+    }
+    for (const auto& child : node->getChildren()) {
+        if (child) {
+            found.extend(traverseAndCheckContentBounds(child.get(), consistent));
+        }
+    }
+    if (found != node->getContentBounds()) {
+        consistent = false;
+    }
+    return found;
+}
+
+bool verifyContentBounds(QuadTree& tree) {
+    if (!tree.getOptions().trackContentBounds) {
+        return true;
+    }
+    bool consistent = true;
+    traverseAndCheckContentBounds(tree.getRoot().get(), consistent);
+    return consistent;
+}
+
+// Test 21: Verify reordering keeps every particle and returns a consistent remap table
+bool verifyReorder(QuadTree& tree, std::vector<std::shared_ptr<Particle>>& particles) {
+    std::vector<Point2D> positions;
+    for (const auto& particle : particles) {
+        positions.push_back(particle->getPosition());
+    }
+    // una referencia guardada fuera del árbol debe seguir apuntando a la partícula indexada
+    std::shared_ptr<Particle> held = particles.front();
+    std::vector<size_t> remap = tree.reorderParticles(particles);
+    if (remap.size() != positions.size() || tree.getParticles() != particles || particles[remap[0]] != held ||
+        tree.scatter() > 0.01) {
+        return false;
+    }
+    std::vector<bool> seen(remap.size(), false);
+    for (size_t i = 0; i < remap.size(); ++i) {
+        if (remap[i] >= remap.size() || seen[remap[i]] || particles[remap[i]]->getPosition() != positions[i]) {
+            return false;
+        }
+        seen[remap[i]] = true;
+    }
+    // nada se ha movido desde el reordenamiento, salvo que venza el intervalo
+    if (!tree.maybeReorder(particles, 1000, 0.1).empty() || tree.maybeReorder(particles, 1, 0.1).size() != remap.size()) {
+        return false;
+    }
+    return verifySubtreeCounts(tree.getRoot().get(), particles.size());
+}
+
+// Test 22: Verify the small-k path at k == smallK and its fallback when the frontier overflows
+bool sameKnnDistances(const Point2D& queryPoint, std::vector<std::shared_ptr<Particle>> knnTree,
+                      std::vector<std::shared_ptr<Particle>> particles, size_t k) {
+    std::sort(particles.begin(), particles.end(), [&queryPoint](const std::shared_ptr<Particle>& a, const std::shared_ptr<Particle>& b) {
+        return queryPoint.distance(a->getPosition()) < queryPoint.distance(b->getPosition());
+    });
+    particles.resize(std::min(k, particles.size()));
+    if (knnTree.size() != particles.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < particles.size(); ++i) {
+        if (queryPoint.distance(knnTree[i]->getPosition()) != queryPoint.distance(particles[i]->getPosition())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool verifySmallKnn(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    Point2D queryPoint(posDistX(gen), posDistY(gen));
+    if (!sameKnnDistances(queryPoint, tree.knn(queryPoint, QuadTree::smallK), particles, QuadTree::smallK)) {
+        return false;
+    }
+
+    // Una cadena de 90 niveles con tres hermanos por nivel: la frontera de 256 entradas se desborda
+    // antes de llegar al fondo y responde el camino general. Los lados bajan de 2^100 a 2^11 para que
+    // la tolerancia de NType no junte los niveles del fondo
+    float side = std::ldexp(1.0f, 100);
+    QuadTree deepTree(Rect(Point2D(0, 0), Point2D(side, side)));
+    std::vector<std::shared_ptr<Particle>> chain;
+    for (int level = 0; level < 90; ++level, side /= 2) {
+        chain.push_back(std::make_shared<Particle>(Point2D(0.75f * side, 0.25f * side), Point2D()));
+        chain.push_back(std::make_shared<Particle>(Point2D(0.25f * side, 0.75f * side), Point2D()));
+        chain.push_back(std::make_shared<Particle>(Point2D(0.75f * side, 0.75f * side), Point2D()));
+    }
+    deepTree.insert(chain);
+    Point2D origin(0, 0);
+    return sameKnnDistances(origin, deepTree.knn(origin, QuadTree::smallK), chain, QuadTree::smallK);
+}
+
+// Test 23: Verify a quantized tree reports particles that leave the root and takes far-away points
+bool verifyQuantizedEscape(const Rect& boundary) {
+    std::vector<std::shared_ptr<Particle>> particles = generateRandomParticles(50, boundary, 0.0);
+    auto leaving = std::make_shared<Particle>(Point2D(99, 50), Point2D());
+    particles.push_back(leaving);
+    QuadTree quantized(boundary);
+    quantized.enableQuantization(16);
+    quantized.insert(particles);
+
+    // un punto muy lejano se satura en el borde de la malla sin salirse del rango del entero
+    Point2D far(1e20f, 5);
+    if (quantized.knn(far, 1).size() != 1 || mortonEncode(Quantizer(boundary, 16), far) != mortonEncode(0xFFFF, 5 * 65536 / 100)) {
+        return false;
+    }
+
+    leaving->setPosition(Point2D(150, 50));
+    std::vector<std::shared_ptr<Particle>> escaped;
+    quantized.updateTree(escaped);
+    if (escaped.size() != 1 || escaped[0] != leaving || quantized.size() != 50) {
+        return false;
+    }
+
+    // sin lista de escapados debe lanzar como el árbol sin cuantizar
+    leaving->setPosition(Point2D(99, 50));
+    QuadTree strict(boundary);
+    strict.enableQuantization(16);
+    strict.insert(particles);
+    leaving->setPosition(Point2D(150, 50));
+    try {
+        strict.updateTree();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+// Test 24: Verify the compact tree decodes within one grid step and answers like brute force over what it stores
+bool verifyCompactQuadTree(const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
+    std::vector<Particle> copies;
+    for (const auto& particle : particles) {
+        copies.push_back(*particle);
+    }
+    try {
+        CompactQuadTree outside(boundary, {Particle(boundary.getPmax() + Point2D(1, 1), Point2D())});
+        return false;
+    } catch (const std::runtime_error&) {
+    }
+
+    // el paso de la raíz acota el de cualquier hoja
+    float stepX = (boundary.getPmax().getX() - boundary.getPmin().getX()).getValue() / 65535.0f;
+    float stepY = (boundary.getPmax().getY() - boundary.getPmin().getY()).getValue() / 65535.0f;
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_real_distribution<float> posDistX(boundary.getPmin().getX().getValue(), boundary.getPmax().getX().getValue());
+    std::uniform_real_distribution<float> posDistY(boundary.getPmin().getY().getValue(), boundary.getPmax().getY().getValue());
+    for (bool mortonOrder : {false, true}) {
+        CompactQuadTree compact(boundary, copies, 64, mortonOrder);
+        std::vector<Particle> stored = compact.getParticles();
+        if (compact.size() != copies.size() || stored.size() != copies.size() ||
+            compact.memoryUsage() >= copies.size() * (sizeof(std::shared_ptr<Particle>) + sizeof(Particle))) {
+            return false;
+        }
+        for (const auto& particle : copies) {
+            std::vector<Particle> nearest = compact.knn(particle.getPosition(), 1);
+            if (nearest.size() != 1 ||
+                std::abs((nearest[0].getPosition().getX() - particle.getPosition().getX()).getValue()) > stepX ||
+                std::abs((nearest[0].getPosition().getY() - particle.getPosition().getY()).getValue()) > stepY) {
+                return false;
+            }
+        }
+
+        Point2D queryPoint(posDistX(gen), posDistY(gen));
+        size_t k = std::uniform_int_distribution<size_t>(1, 10)(gen);
+        std::vector<Particle> knnCompact = compact.knn(queryPoint, k);
+        std::vector<float> knnBruteForce;
+        for (const auto& particle : stored) {
+            knnBruteForce.push_back(queryPoint.distance(particle.getPosition()).getValue());
+        }
+        std::partial_sort(knnBruteForce.begin(), knnBruteForce.begin() + k, knnBruteForce.end());
+        if (knnCompact.size() != k) {
+            return false;
+        }
+        for (size_t i = 0; i < k; ++i) {
+            if (queryPoint.distance(knnCompact[i].getPosition()) != knnBruteForce[i]) {
+                return false;
+            }
+        }
+
+        Rect region = randomRegion(gen, boundary);
+        size_t inRegion = std::count_if(stored.begin(), stored.end(), [&region](const Particle& p) {
+            return region.contains(p.getPosition());
+        });
+        if (compact.range(region).size() != inRegion) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Run all tests
 bool runTesting(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& particles, const Rect& boundary) {
     bool allTestsPassed = true;
@@ -281,12 +923,74 @@ bool runTesting(QuadTree& tree, const std::vector<std::shared_ptr<Particle>>& pa
         allTestsPassed = false;
     }
 
+    if (!verifyRangeSearch(tree, particles, boundary)) {
+        std::cout << "Test failed: Range search did not return the expected results." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyPredictiveRangeSearch(tree, particles, boundary)) {
+        std::cout << "Test failed: Predictive range search did not return the expected results." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyPredictiveKnnSearch(tree, particles, boundary)) {
+        std::cout << "Test failed: Predictive k-NN search did not return the expected results." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyAllKnn(tree)) {
+        std::cout << "Test failed: all-kNN did not match the k-NN search." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifySubtreeCounts(tree.getRoot().get(), particles.size())) {
+        std::cout << "Test failed: Subtree counts do not match the indexed particles." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyCountQueries(tree, particles, boundary)) {
+        std::cout << "Test failed: Count queries did not return the expected results." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyShapeQueries(tree, particles, boundary)) {
+        std::cout << "Test failed: Shape queries did not return the expected results." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyContentBounds(tree)) {
+        std::cout << "Test failed: Content bounds do not match the indexed particles." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifySmallKnn(tree, particles, boundary)) {
+        std::cout << "Test failed: Small-k k-NN did not match brute force." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyQueryService(tree, boundary)) {
+        std::cout << "Test failed: query service did not match the direct queries." << std::endl;
+        allTestsPassed = false;
+    }
+
+    if (!verifyTrackedKnn(tree, boundary)) {
+        std::cout << "Test failed: tracked k-NN did not match the k-NN search." << std::endl;
+        allTestsPassed = false;
+    }
+
     return allTestsPassed;
 }
 
 int main() {
+#ifdef QUADTREE_TRACING
+    // contadores de hardware por fase, si el kernel lo permite
+    if (std::getenv("QUADTREE_TRACE_COUNTERS") != nullptr) {
+        Trace::enableCounters();
+    }
+#endif
     Rect boundary(Point2D(0, 0), Point2D(100, 100));
     QuadTree tree(boundary);
+    tree.enableVelocityBounds();
     bool allTestsPassed;
 
     int numParticles = 200000;
@@ -302,18 +1006,105 @@ int main() {
         std::cout << "Some tests failed." << std::endl;
     }
 
+    // Desde aquí las consultas podan con los límites del contenido de cada nodo
+    tree.enableContentBounds();
+
+    // Reordenar las partículas en memoria según la curva del árbol
+    bool reorderPassed = verifyReorder(tree, particles);
+    if (!reorderPassed) {
+        std::cout << "Test failed: Reordering lost particles or returned a wrong remap." << std::endl;
+    }
+
     // Mover partículas y actualizar el árbol
     std::cout << std::endl << "Updating particles..." << std::endl;
+    {
+        QT_TRACE_SCOPE("main: move particles");
+        for (auto& particle : particles) {
+            particle->updatePosition(boundary);
+        }
+    }
+    tree.updateTree();
+    allTestsPassed = runTesting(tree, particles, boundary) && reorderPassed;
+    if (allTestsPassed) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Some tests failed." << std::endl;
+    }
+
+    // Árbol en disco con las mismas partículas
+    std::cout << std::endl << "Paged tree..." << std::endl;
+    if (verifyPagedQuadTree(particles, boundary)) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Test failed: Paged tree queries did not return the expected results." << std::endl;
+    }
+
+    // Árbol cuantizado con las mismas partículas
+    std::cout << std::endl << "Quantized tree..." << std::endl;
+    QuadTree quantizedTree(boundary);
+    quantizedTree.enableQuantization(16);
+    quantizedTree.enableVelocityBounds();
+    quantizedTree.insert(particles);
     for (auto& particle : particles) {
         particle->updatePosition(boundary);
     }
-    tree.updateTree();
-    allTestsPassed = runTesting(tree, particles, boundary);
+    quantizedTree.updateTree();
+    allTestsPassed = runTesting(quantizedTree, particles, boundary);
+    if (allTestsPassed) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Some tests failed." << std::endl;
+    }
+
+    // Árbol suelto con las mismas partículas, sin tocar la configuración de los demás árboles
+    std::cout << std::endl << "Loose tree..." << std::endl;
+    QuadTree looseTree(boundary, QuadTree::bucketSize, 2.0f);
+    looseTree.enableVelocityBounds();
+    looseTree.enableContentBounds();
+    looseTree.insert(particles);
+    for (auto& particle : particles) {
+        particle->updatePosition(boundary);
+    }
+    looseTree.updateTree();
+    allTestsPassed = runTesting(looseTree, particles, boundary);
+    if (tree.getOptions().looseFactor != 1.0f || quantizedTree.getOptions().looseFactor != 1.0f ||
+        quantizedTree.getOptions().trackContentBounds) {
+        std::cout << "Test failed: Tree settings leaked into other trees." << std::endl;
+        allTestsPassed = false;
+    }
     if (allTestsPassed) {
         std::cout << "All tests passed!" << std::endl;
     } else {
         std::cout << "Some tests failed." << std::endl;
     }
 
+    // Partículas que salen de un árbol cuantizado
+    std::cout << std::endl << "Quantized escape..." << std::endl;
+    if (verifyQuantizedEscape(boundary)) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Test failed: Quantized tree kept a particle outside its root." << std::endl;
+    }
+
+    // Árbol compacto con posiciones de 4 bytes
+    std::cout << std::endl << "Compact tree..." << std::endl;
+    if (verifyCompactQuadTree(particles, boundary)) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Test failed: Compact tree did not match its stored particles." << std::endl;
+    }
+
+    // Simulación repartida en shards
+    std::cout << std::endl << "Sharded tree..." << std::endl;
+    if (verifyShardedQuadTree(boundary)) {
+        std::cout << "All tests passed!" << std::endl;
+    } else {
+        std::cout << "Test failed: Sharded tree did not match brute force." << std::endl;
+    }
+
+#ifdef QUADTREE_TRACING
+    Trace::dump("quadtree-trace.json");
+    std::cout << std::endl << "Trace written to quadtree-trace.json" << std::endl;
+#endif
     return 0;
 }